@@ -0,0 +1,503 @@
+// --------------------------------------------------------------------
+// Conversion of a PDF document with given options
+// --------------------------------------------------------------------
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "goo/GooString.h"
+#include "Object.h"
+#include "Stream.h"
+#include "Dict.h"
+#include "XRef.h"
+#include "Catalog.h"
+#include "Page.h"
+#include "PDFDoc.h"
+#include "GlobalParams.h"
+
+#include "converter.h"
+#include "xmloutputdev.h"
+#include "scheduler.h"
+
+// Open the PDF document, using the passwords from the options.
+static PDFDoc *openPDF(const PdfInput &input, const ConvertOptions &options)
+{
+  #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
+    std::optional<GooString> ownerPW, userPW;
+  #else
+    GooString *ownerPW, *userPW;
+  #endif
+  if (options.ownerPassword[0]) {
+    #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
+      ownerPW = GooString(options.ownerPassword);
+    #else
+      ownerPW = new GooString(options.ownerPassword);
+    #endif
+  } else {
+    #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
+      ownerPW = std::nullopt;
+    #else
+      ownerPW = 0;
+    #endif
+  }
+  if (options.userPassword[0]) {
+    #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
+      userPW = GooString(options.userPassword);
+    #else
+      userPW = new GooString(options.userPassword);
+    #endif
+  } else {
+    #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
+      userPW = std::nullopt;
+    #else
+      userPW = 0;
+    #endif
+  }
+
+  PDFDoc *doc;
+  if (input.data) {
+    BaseStream *str = new MemStream(input.data, 0, input.size,
+				    Object(objNull));
+    doc = new PDFDoc(str, ownerPW, userPW);
+  } else {
+    #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
+      doc = new PDFDoc(std::make_unique<GooString>(input.fileName.c_str()),
+		       ownerPW, userPW);
+    #else
+      doc = new PDFDoc(new GooString(input.fileName.c_str()), ownerPW, userPW);
+    #endif
+  }
+  #if !POPPLER_VERSION_AT_LEAST(22, 3, 0)
+    delete userPW;
+    delete ownerPW;
+  #endif
+  return doc;
+}
+
+// Pass the options to an output device converting doc.
+static void setOptions(XmlOutputDev *xmlOut, PDFDoc *doc,
+		       const ConvertOptions &options)
+{
+  xmlOut->setTextHandling(options.math, options.notext, options.literal,
+			  options.mergeLevel, options.noTextSize,
+			  options.unicodeLevel);
+  xmlOut->setImageHandling(options.base64, options.flateLevel, options.dedup);
+  xmlOut->setShadingHandling(options.gradients, options.patterns);
+  if (options.forms)
+    xmlOut->setFormHandling(doc);
+  xmlOut->setPathHandling(options.symbolThreshold,
+			  options.simplifyTolerance);
+  xmlOut->setColorHandling(options.palette);
+  xmlOut->setPenHandling(options.penTolerance);
+  xmlOut->setPrecision(options.precision);
+}
+
+// Length of obj if it is a stream, otherwise zero.
+static double streamLength(const Object &obj)
+{
+  if (!obj.isStream())
+    return 0.0;
+  Object length = obj.streamGetDict()->lookup("Length");
+  return length.isNum() ? length.getNum() : 0.0;
+}
+
+// Estimated cost of converting a page: the size of its content
+// streams and of the external objects (images and forms) it uses.
+static double pageCost(PDFDoc *doc, int pageNum)
+{
+  Page *page = doc->getPage(pageNum);
+  if (!page)
+    return 0.0;
+  double cost = 1024.0; // fixed overhead of every page
+  Object contents = page->getContents();
+  if (contents.isArray()) {
+    for (int i = 0; i < contents.arrayGetLength(); ++i)
+      cost += streamLength(contents.arrayGet(i));
+  } else
+    cost += streamLength(contents);
+  Dict *resources = page->getResourceDict();
+  if (resources) {
+    Object xobjects = resources->lookup("XObject");
+    if (xobjects.isDict()) {
+      for (int i = 0; i < xobjects.dictGetLength(); ++i)
+	cost += streamLength(xobjects.dictGetVal(i));
+    }
+  }
+  return cost;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now()
+				       - start).count();
+}
+
+// Open the PDF document in a worker thread.  An exception escaping the
+// thread would terminate the program, so failures return null.
+static PDFDoc *openWorkerPDF(const PdfInput &input,
+			     const ConvertOptions &options)
+{
+  try {
+    PDFDoc *doc = openPDF(input, options);
+    if (doc->isOk())
+      return doc;
+    delete doc;
+  } catch (...) {
+  }
+  return nullptr;
+}
+
+// Convert the pages with several threads.  Each thread opens its own
+// PDFDoc and converts a range of pages into memory.  The pages are
+// written to xmlOut in order, each as soon as it and all pages before
+// it are complete, so the result is the same as with a single thread.
+// Returns false if a page could not be converted.
+static bool convertParallel(XmlOutputDev *xmlOut, PDFDoc *mainDoc,
+			    const PdfInput &input, int first, int last,
+			    const ConvertOptions &options)
+{
+  int jobs = options.numThreads;
+  int numPages = last - first + 1;
+  if (jobs > numPages)
+    jobs = numPages;
+  std::vector<double> costs(numPages);
+  for (int i = 0; i < numPages; ++i)
+    costs[i] = pageCost(mainDoc, first + i);
+  PageScheduler scheduler(costs, jobs);
+
+  std::vector<std::string> pages(numPages);
+  std::vector<char> unicode(numPages, 0);
+  std::vector<char> done(numPages, 0);
+  bool ok = true;
+  std::mutex mutex;
+  std::condition_variable pageDone;
+  auto start = std::chrono::steady_clock::now();
+
+  // a page that fails, even with an exception, is left empty
+  auto worker = [&](int id) {
+    std::unique_ptr<PDFDoc> doc(openWorkerPDF(input, options));
+    int i;
+    while ((i = scheduler.next(id)) >= 0) {
+      auto pageStart = std::chrono::steady_clock::now();
+      std::string xml;
+      bool hasUnicode = false;
+      bool pageOk = doc != nullptr;
+      if (pageOk) {
+	try {
+	  XmlOutputDev pageOut(xml, doc->getXRef(), i + 1);
+	  setOptions(&pageOut, doc.get(), options);
+	  doc->displayPage(&pageOut, first + i, 72.0, 72.0, 0,
+			   false, false, false);
+	  hasUnicode = pageOut.hasUnicode();
+	} catch (...) {
+	  pageOk = false;
+	  xml.clear();
+	}
+      }
+      if (!pageOk)
+	fprintf(stderr, "Couldn't convert page %d\n", first + i);
+      scheduler.addBusyTime(id, secondsSince(pageStart));
+      std::lock_guard<std::mutex> lock(mutex);
+      ok = ok && pageOk;
+      pages[i] = std::move(xml);
+      unicode[i] = hasUnicode;
+      done[i] = 1;
+      pageDone.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int id = 0; id < jobs; ++id)
+    threads.emplace_back(worker, id);
+
+  for (int i = 0; i < numPages; ++i) {
+    std::string xml;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      pageDone.wait(lock, [&] { return done[i] != 0; });
+      xml = std::move(pages[i]);
+    }
+    xmlOut->appendPages(xml, unicode[i]);
+  }
+
+  for (auto &thread : threads)
+    thread.join();
+
+  if (!options.quiet)
+    scheduler.report(stderr, secondsSince(start));
+  return ok;
+}
+
+static void reportUnicode(const ConvertOptions &options)
+{
+  fprintf(stderr, "The document contains Unicode (non-ASCII) text.\n");
+  if (options.unicodeLevel <= 1)
+    fprintf(stderr, "Unknown Unicode characters were replaced by [U+XXX].\n");
+  else
+    fprintf(stderr, "UTF-8 was set as document encoding in the preamble.\n");
+}
+
+// Name of the Ipe file for a page in split mode: "foo.ipe" becomes
+// "foo-3.ipe" for page 3.
+static std::string splitFileName(const std::string &xmlFileName,
+				 int pageNum)
+{
+  std::string base = xmlFileName;
+  if (base.size() > 4 && base.compare(base.size() - 4, 4, ".ipe") == 0)
+    base.resize(base.size() - 4);
+  return base + "-" + std::to_string(pageNum) + ".ipe";
+}
+
+// Convert a single page into a complete Ipe file of its own, with the
+// layout taken from that page.  The file is closed before returning.
+static bool convertSplitPage(PDFDoc *doc, int pageNum,
+			     const std::string &xmlFileName,
+			     const ConvertOptions &options, bool *unicode)
+{
+  XmlOutputDev xmlOut(splitFileName(xmlFileName, pageNum), doc->getXRef(),
+		      doc->getCatalog(), pageNum, pageNum);
+  if (!xmlOut.isOk())
+    return false;
+  setOptions(&xmlOut, doc, options);
+  doc->displayPage(&xmlOut, pageNum, 72.0, 72.0, 0, false, false, false);
+  *unicode = xmlOut.hasUnicode();
+  return true;
+}
+
+// Convert every page into its own Ipe file.  With several threads,
+// each thread opens its own PDFDoc and writes its files directly.
+static bool convertSplit(PDFDoc *mainDoc, const PdfInput &input,
+			 const std::string &xmlFileName, int first, int last,
+			 const ConvertOptions &options, bool *unicode)
+{
+  int jobs = options.numThreads;
+  int numPages = last - first + 1;
+  if (jobs > numPages)
+    jobs = numPages;
+  bool ok = true;
+  if (jobs <= 1) {
+    for (int i = first; i <= last && ok; ++i) {
+      bool pageUnicode = false;
+      ok = convertSplitPage(mainDoc, i, xmlFileName, options, &pageUnicode);
+      *unicode = *unicode || pageUnicode;
+    }
+    return ok;
+  }
+
+  std::vector<double> costs(numPages);
+  for (int i = 0; i < numPages; ++i)
+    costs[i] = pageCost(mainDoc, first + i);
+  PageScheduler scheduler(costs, jobs);
+  std::mutex mutex;
+  auto start = std::chrono::steady_clock::now();
+
+  auto worker = [&](int id) {
+    std::unique_ptr<PDFDoc> doc(openWorkerPDF(input, options));
+    int i;
+    while ((i = scheduler.next(id)) >= 0) {
+      auto pageStart = std::chrono::steady_clock::now();
+      bool pageUnicode = false;
+      bool pageOk = false;
+      try {
+	pageOk = doc
+	  && convertSplitPage(doc.get(), first + i, xmlFileName, options,
+			      &pageUnicode);
+      } catch (...) {
+      }
+      if (!pageOk)
+	fprintf(stderr, "Couldn't convert page %d\n", first + i);
+      scheduler.addBusyTime(id, secondsSince(pageStart));
+      std::lock_guard<std::mutex> lock(mutex);
+      ok = ok && pageOk;
+      *unicode = *unicode || pageUnicode;
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int id = 0; id < jobs; ++id)
+    threads.emplace_back(worker, id);
+  for (auto &thread : threads)
+    thread.join();
+
+  if (!options.quiet)
+    scheduler.report(stderr, secondsSince(start));
+  return ok;
+}
+
+std::string defaultXmlFileName(const std::string &fileName)
+{
+  size_t n = fileName.size();
+  if (n >= 4 && (fileName.compare(n - 4, 4, ".pdf") == 0 ||
+		 fileName.compare(n - 4, 4, ".PDF") == 0))
+    return fileName.substr(0, n - 4) + ".ipe";
+  return fileName + ".ipe";
+}
+
+// Open the PDF document and find the page range to convert.  Returns
+// null and sets the exit code if the document cannot be opened or the
+// range has no pages.
+static PDFDoc *openDocument(const PdfInput &input,
+			    const ConvertOptions &options,
+			    int *first, int *last, int *exitCode)
+{
+  PDFDoc *doc = openPDF(input, options);
+  if (!doc->isOk()) {
+    delete doc;
+    *exitCode = 1;
+    return nullptr;
+  }
+  *first = options.firstPage < 1 ? 1 : options.firstPage;
+  *last = options.lastPage;
+  if (*last < 1 || *last > doc->getNumPages())
+    *last = doc->getNumPages();
+  if (*first > *last) {
+    fprintf(stderr, "No pages to convert: the document has %d pages.\n",
+	    doc->getNumPages());
+    delete doc;
+    *exitCode = 3;
+    return nullptr;
+  }
+  return doc;
+}
+
+// Name of an option that needs all pages in a single output device,
+// or null if the pages can be converted by several threads.
+static const char *wholeDocumentOption(const ConvertOptions &options)
+{
+  if (options.dedup)
+    return "-dedup";
+  if (options.gradients)
+    return "-gradients";
+  if (options.patterns)
+    return "-patterns";
+  if (options.forms)
+    return "-forms";
+  if (options.symbolThreshold > 0)
+    return "-symbols";
+  if (options.palette)
+    return "-palette";
+  if (options.penTolerance > 0)
+    return "-pens";
+  return nullptr;
+}
+
+// Convert the pages into an output device writing a complete document.
+static int convertDocument(PDFDoc *doc, XmlOutputDev *xmlOut,
+			   const PdfInput &input, int first, int last,
+			   const ConvertOptions &options)
+{
+  // tell output device about text and image handling
+  setOptions(xmlOut, doc, options);
+  
+  int exitCode = 2;
+  if (xmlOut->isOk()) {
+    const char *single = wholeDocumentOption(options);
+    if (options.numThreads > 1 && single)
+      fprintf(stderr, "Option %s needs a single thread, ignoring -j.\n",
+	      single);
+    if (options.numThreads > 1 && !single && last > first) {
+      if (convertParallel(xmlOut, doc, input, first, last, options))
+	exitCode = 0;
+    } else {
+      doc->displayPages(xmlOut, first, last, 
+			// double hDPI, double vDPI, int rotate,
+			// bool useMediaBox, bool crop, bool printing,
+			72.0, 72.0, 0, false, false, false);
+      exitCode = 0;
+    }
+  }
+
+  if (xmlOut->hasUnicode())
+    reportUnicode(options);
+
+  return exitCode;
+}
+
+int convertFile(const PdfInput &input, const std::string &xmlFileName,
+		const ConvertOptions &options)
+{
+  int first, last, exitCode;
+  std::unique_ptr<PDFDoc> doc(openDocument(input, options, &first, &last,
+					   &exitCode));
+  if (!doc)
+    return exitCode;
+
+  if (options.split && xmlFileName == "-") {
+    fprintf(stderr, "Option -split cannot write to standard output.\n");
+    return 3;
+  }
+
+  if (options.split) {
+    bool unicode = false;
+    exitCode = convertSplit(doc.get(), input, xmlFileName,
+				first, last, options, &unicode) ? 0 : 2;
+    if (unicode)
+      reportUnicode(options);
+    return exitCode;
+  }
+
+  // write XML file
+  XmlOutputDev xmlOut(xmlFileName, doc->getXRef(), doc->getCatalog(),
+		      first, last);
+  return convertDocument(doc.get(), &xmlOut, input, first, last, options);
+}
+
+int convertToSink(const PdfInput &input, const XmlSink &sink,
+		  const ConvertOptions &options)
+{
+  int first, last, exitCode;
+  std::unique_ptr<PDFDoc> doc(openDocument(input, options, &first, &last,
+					   &exitCode));
+  if (!doc)
+    return exitCode;
+
+  if (options.split) {
+    fprintf(stderr, "Option -split needs an output file.\n");
+    return 3;
+  }
+
+  // the trailer is written when xmlOut is destroyed
+  {
+    XmlOutputDev xmlOut(sink, doc->getXRef(), doc->getCatalog(), first, last);
+    exitCode = convertDocument(doc.get(), &xmlOut, input, first, last,
+			       options);
+  }
+  return exitCode;
+}
+
+int convertToString(const PdfInput &input, std::string &xml,
+		    const ConvertOptions &options)
+{
+  return convertToSink(input, [&xml](const char *data, size_t len) {
+      xml.append(data, len); }, options);
+}
+
+const char *exitCodeMessage(int exitCode)
+{
+  switch (exitCode) {
+  case 1:
+    return "cannot open PDF document";
+  case 3:
+    return "invalid options";
+  default:
+    return "cannot convert";
+  }
+}
+
+void initConverter(bool quiet)
+{
+  globalParams = std::make_unique<GlobalParams>();
+  if (quiet)
+    globalParams->setErrQuiet(quiet);
+}
+
+// --------------------------------------------------------------------
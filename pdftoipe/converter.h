@@ -0,0 +1,85 @@
+// -*- C++ -*-
+// --------------------------------------------------------------------
+// Converter.h
+// --------------------------------------------------------------------
+
+#ifndef CONVERTER_H
+#define CONVERTER_H
+
+#include <stddef.h>
+
+#include <functional>
+#include <string>
+
+// Conversion of PDF documents to Ipe documents.  This is the interface
+// of libpdftoipe, and used by the pdftoipe program itself.
+
+// Options of a conversion, as given on the command line.
+struct ConvertOptions {
+  int firstPage = 1;
+  int lastPage = 0; // 0 for the last page of the document
+  int mergeLevel = 0;
+  int unicodeLevel = 1;
+  int precision = -1;
+  char ownerPassword[33] = "";
+  char userPassword[33] = "";
+  bool quiet = false;
+  bool math = false;
+  bool literal = false;
+  bool notext = false;
+  bool noTextSize = false;
+  bool base64 = false;
+  int flateLevel = 0;
+  bool dedup = false;
+  bool gradients = false;
+  bool patterns = false;
+  bool forms = false;
+  int symbolThreshold = 0; // 0 to draw repeated paths in full
+  double simplifyTolerance = 0; // 0 to keep all vertices
+  bool palette = false;
+  double penTolerance = 0; // 0 to write pens and dashes literally
+  int numThreads = 1;
+  bool split = false;
+};
+
+// The PDF document to convert: a file, or the contents of a PDF file
+// in memory.  The memory must stay valid during the conversion.
+struct PdfInput {
+  std::string fileName;
+  const char *data = nullptr; // used instead of fileName if not null
+  size_t size = 0;
+};
+
+// Convert the PDF document to an Ipe file ("-" for stdout).  Returns
+// 0 on success, 1 if the PDF document cannot be opened, 2 if the
+// conversion fails, and 3 if the options do not fit the document or
+// the output, such as a page range without pages.
+int convertFile(const PdfInput &input, const std::string &xmlFileName,
+                const ConvertOptions &options);
+
+// Convert the PDF document to an Ipe document in memory, appending it
+// to xml.  Returns an exit code like convertFile.
+int convertToString(const PdfInput &input, std::string &xml,
+                    const ConvertOptions &options);
+
+// Receives the Ipe document in blocks while it is being written.
+typedef std::function<void(const char *data, size_t len)> XmlSink;
+
+// Convert the PDF document, passing the Ipe document to sink.  Returns
+// an exit code like convertFile.
+int convertToSink(const PdfInput &input, const XmlSink &sink,
+                  const ConvertOptions &options);
+
+// What went wrong, by the exit code of a conversion.
+const char *exitCodeMessage(int exitCode);
+
+// Set up poppler's global parameters.  Must be called once before the
+// first conversion.
+void initConverter(bool quiet);
+
+// Default name of the Ipe file: the PDF file name with ".ipe" instead
+// of ".pdf".
+std::string defaultXmlFileName(const std::string &fileName);
+
+// --------------------------------------------------------------------
+#endif
@@ -0,0 +1,85 @@
+// --------------------------------------------------------------------
+// Streaming zlib compressor for image data
+// --------------------------------------------------------------------
+
+#include "deflater.h"
+
+#include <string.h>
+
+//------------------------------------------------------------------------
+// Deflater
+//------------------------------------------------------------------------
+
+Deflater::Deflater(int level) : iSize(0), iSpill(nullptr) {
+  memset(&iStream, 0, sizeof(iStream));
+  iOk = (deflateInit(&iStream, level) == Z_OK);
+}
+
+Deflater::~Deflater() {
+  if (iOk)
+    deflateEnd(&iStream);
+  if (iSpill)
+    fclose(iSpill);
+}
+
+void Deflater::put(const unsigned char *data, size_t len) {
+  while (len > 0) {
+    // avail_in is only 32 bits wide
+    uInt n = len < (1u << 30) ? uInt(len) : (1u << 30);
+    iStream.next_in = const_cast<Bytef *>(data);
+    iStream.avail_in = n;
+    drain(Z_NO_FLUSH);
+    data += n;
+    len -= n;
+  }
+}
+
+void Deflater::finish() {
+  iStream.next_in = nullptr;
+  iStream.avail_in = 0;
+  drain(Z_FINISH);
+  if (iSpill)
+    fflush(iSpill);
+}
+
+void Deflater::drain(int flush) {
+  int status;
+  do {
+    iStream.next_out = iChunk;
+    iStream.avail_out = kChunkSize;
+    status = deflate(&iStream, flush);
+    store(iChunk, kChunkSize - iStream.avail_out);
+  } while (iStream.avail_out == 0 ||
+           (flush == Z_FINISH && status == Z_OK));
+}
+
+void Deflater::store(const unsigned char *data, size_t len) {
+  if (len == 0)
+    return;
+  iSize += len;
+  if (!iSpill && iMemory.size() + len > kMemoryLimit) {
+    iSpill = tmpfile();
+    if (iSpill) {
+      fwrite(iMemory.data(), 1, iMemory.size(), iSpill);
+      iMemory.clear();
+      iMemory.shrink_to_fit();
+    }
+  }
+  if (iSpill)
+    fwrite(data, 1, len, iSpill);
+  else
+    iMemory.insert(iMemory.end(), data, data + len);
+}
+
+void Deflater::copyTo(const Sink &sink) {
+  if (!iSpill) {
+    sink(iMemory.data(), iMemory.size());
+    return;
+  }
+  rewind(iSpill);
+  size_t n;
+  while ((n = fread(iChunk, 1, kChunkSize, iSpill)) > 0)
+    sink(iChunk, n);
+}
+
+// --------------------------------------------------------------------
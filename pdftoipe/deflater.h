@@ -0,0 +1,63 @@
+// -*- C++ -*-
+// --------------------------------------------------------------------
+// Deflater.h
+// --------------------------------------------------------------------
+
+#ifndef DEFLATER_H
+#define DEFLATER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <functional>
+#include <vector>
+
+#include <zlib.h>
+
+// Streaming zlib compressor for image data.
+//
+// Ipe needs the length of a compressed image before its data, so the
+// compressed bytes are kept until finish() has been called.  They stay
+// in memory up to a limit, larger results are spilled to a temporary
+// file, so memory use is bounded for arbitrarily large images.
+class Deflater {
+public:
+  using Sink = std::function<void(const unsigned char *data, size_t len)>;
+
+  explicit Deflater(int level);
+  ~Deflater();
+
+  Deflater(const Deflater &) = delete;
+  Deflater &operator=(const Deflater &) = delete;
+
+  // Check if the compressor was set up successfully.
+  bool isOk() const { return iOk; }
+
+  // Compress more input.
+  void put(const unsigned char *data, size_t len);
+  // Flush the compressor.  No more input can be added after this.
+  void finish();
+
+  // Size of the compressed data (valid after finish).
+  size_t size() const { return iSize; }
+  // Pass the compressed data to sink in chunks (valid after finish).
+  void copyTo(const Sink &sink);
+
+private:
+  void drain(int flush);
+  void store(const unsigned char *data, size_t len);
+
+private:
+  static constexpr size_t kChunkSize = 1 << 16;
+  static constexpr size_t kMemoryLimit = 1 << 22;
+
+  z_stream iStream;
+  bool iOk;
+  size_t iSize;
+  unsigned char iChunk[kChunkSize];
+  std::vector<unsigned char> iMemory;
+  FILE *iSpill; // temporary file once iMemory is full
+};
+
+// --------------------------------------------------------------------
+#endif
@@ -2,192 +2,240 @@
 // Pdftoipe: convert PDF file to editable Ipe XML file
 // --------------------------------------------------------------------
 
+#include <algorithm>
+#include <chrono>
 #include <memory>
+#include <string>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
 
-#include "goo/GooString.h"
-#include "goo/gmem.h"
-#include "Object.h"
-#include "Stream.h"
-#include "Array.h"
-#include "Dict.h"
-#include "XRef.h"
-#include "Catalog.h"
-#include "Page.h"
-#include "PDFDoc.h"
-#include "Error.h"
-#include "GlobalParams.h"
-
 #include "parseargs.h"
 #include "xmloutputdev.h"
+#include "converter.h"
+#include "server.h"
 
-static int firstPage = 1;
-static int lastPage = 0;
-static int mergeLevel = 0;
-static int unicodeLevel = 1;
-static char ownerPassword[33] = "";
-static char userPassword[33] = "";
-static bool quiet = false;
+static ConvertOptions options;
 static bool printHelp = false;
-static bool math = false;
-static bool literal = false;
-static bool notext = false;
-static bool noTextSize = false;
-
-static ArgDesc argDesc[] = {
-  {"-f",      argInt,      &firstPage,      0,
-   "first page to convert"},
-  {"-l",      argInt,      &lastPage,       0,
-   "last page to convert"},
-  {"-opw",    argString,   ownerPassword,   sizeof(ownerPassword),
-   "owner password (for encrypted files)"},
-  {"-upw",    argString,   userPassword,    sizeof(userPassword),
-   "user password (for encrypted files)"},
-  {"-q",      argFlag,     &quiet,          0,
-   "don't print any messages or errors"},
-  {"-math",   argFlag,     &math,           0,
-   "turn all text objects into math formulas"},
-  {"-literal", argFlag,    &literal,        0,
-   "allow math mode in input text objects"},
-  {"-notext", argFlag,     &notext,         0,
-   "discard all text objects"},
-  {"-notextsize", argFlag, &noTextSize,     0,
-   "ignore size of text objects"},
-  {"-merge",  argInt,      &mergeLevel,     0,
-   "how eagerly should consecutive text be merged: 0, 1, or 2 (default 0)"},
-  {"-unicode",  argInt,    &unicodeLevel,       0,
-   "how much Unicode should be used: 1, 2, or 3 (default 1)"},
-  {"-h",      argFlag,     &printHelp,      0,
-   "print usage information"},
-  {"-help",   argFlag,     &printHelp,      0,
-   "print usage information"},
-  {"--help",  argFlag,     &printHelp,      0,
-   "print usage information"},
-  {"-?",      argFlag,     &printHelp,      0,
-   "print usage information"},
-  {NULL, argFlag, 0, 0, 0}
-};
+static char batchFile[1024] = "";
+static char serveSocket[108] = "";
+static int numWorkers = 0;
 
-int main(int argc, char *argv[])
+// The table of the conversion options, storing into opts.
+static std::vector<ArgDesc> optionArgs(ConvertOptions &opts)
 {
-  // parse args
-  bool ok = parseArgs(argDesc, &argc, argv);
-  if (!ok || argc < 2 || argc > 3 || printHelp) {
-    fprintf(stderr, "pdftoipe version %s\n", PDFTOIPE_VERSION);
-    printUsage("pdftoipe", "<PDF-file> [<XML-file>]", argDesc);
-    return 1;
+  return {
+    {"-f",      argInt,      &opts.firstPage, 0,
+     "first page to convert"},
+    {"-l",      argInt,      &opts.lastPage, 0,
+     "last page to convert"},
+    {"-opw",    argString,   opts.ownerPassword,
+     sizeof(opts.ownerPassword),
+     "owner password (for encrypted files)"},
+    {"-upw",    argString,   opts.userPassword,
+     sizeof(opts.userPassword),
+     "user password (for encrypted files)"},
+    {"-q",      argFlag,     &opts.quiet,  0,
+     "don't print any messages or errors"},
+    {"-math",   argFlag,     &opts.math,   0,
+     "turn all text objects into math formulas"},
+    {"-literal", argFlag,    &opts.literal, 0,
+     "allow math mode in input text objects"},
+    {"-notext", argFlag,     &opts.notext, 0,
+     "discard all text objects"},
+    {"-notextsize", argFlag, &opts.noTextSize, 0,
+     "ignore size of text objects"},
+    {"-merge",  argInt,      &opts.mergeLevel, 0,
+     "how eagerly should consecutive text be merged: 0 to 3 (default 0)"},
+    {"-unicode",  argInt,    &opts.unicodeLevel, 0,
+     "how much Unicode should be used: 1, 2, or 3 (default 1)"},
+    {"-base64", argFlag,     &opts.base64, 0,
+     "write image data in base64 instead of hex"},
+    {"-flate",  argInt,      &opts.flateLevel, 0,
+     "compress decoded images with this zlib level, 1 to 9 (default: none)"},
+    {"-dedup",  argFlag,     &opts.dedup,  0,
+     "write each distinct image only once"},
+    {"-gradients", argFlag,  &opts.gradients, 0,
+     "convert axial and radial shadings to Ipe gradients"},
+    {"-patterns", argFlag,   &opts.patterns, 0,
+     "draw tiling patterns with Ipe symbols"},
+    {"-forms",  argFlag,     &opts.forms,  0,
+     "draw each form XObject once, as an Ipe symbol"},
+    {"-symbols", argInt,     &opts.symbolThreshold, 0,
+     "draw paths repeated this many times as Ipe symbols (default: never)"},
+    {"-simplify", argFP,     &opts.simplifyTolerance, 0,
+     "leave out vertices of straight segments within this distance"},
+    {"-palette", argFlag,    &opts.palette, 0,
+     "define colors in a style sheet and refer to them by name"},
+    {"-pens",   argFP,       &opts.penTolerance, 0,
+     "round pens and dashes to multiples of this and name them in a style sheet"},
+    {"-precision", argInt,   &opts.precision, 0,
+     "decimals in coordinates, 0 to 17 (default 6 significant digits)"},
+    {"-j",      argInt,      &opts.numThreads, 0,
+     "number of threads converting pages (default 1)"},
+    {"-split",  argFlag,     &opts.split,  0,
+     "write each page to its own Ipe file"},
+  };
+}
+
+// The table of all arguments of the command line.
+static std::vector<ArgDesc> commandArgs()
+{
+  std::vector<ArgDesc> args = optionArgs(options);
+  args.insert(args.end(), {
+    {"-batch",  argString,   batchFile,       sizeof(batchFile),
+     "convert the files listed in this manifest (- for stdin)"},
+    {"--serve", argString,   serveSocket,     sizeof(serveSocket),
+     "serve conversion jobs on this Unix domain socket"},
+    {"-workers", argInt,     &numWorkers,     0,
+     "number of jobs converted at once by --serve (default: all cores)"},
+    {"-h",      argFlag,     &printHelp,      0,
+     "print usage information"},
+    {"-help",   argFlag,     &printHelp,      0,
+     "print usage information"},
+    {"--help",  argFlag,     &printHelp,      0,
+     "print usage information"},
+    {"-?",      argFlag,     &printHelp,      0,
+     "print usage information"},
+    {NULL, argFlag, 0, 0, 0}
+  });
+  return args;
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now()
+				       - start).count();
+}
+
+// Read one line without the line break.  Returns false at the end of
+// the file.
+static bool readLine(FILE *f, std::string &line)
+{
+  line.clear();
+  char buf[1024];
+  while (fgets(buf, sizeof(buf), f)) {
+    line += buf;
+    if (line.back() == '\n') {
+      line.pop_back();
+      if (!line.empty() && line.back() == '\r')
+	line.pop_back();
+      return true;
+    }
   }
+  return !line.empty();
+}
 
-  GooString *fileName = new GooString(argv[1]);
-
-  globalParams = std::make_unique<GlobalParams>();
-  if (quiet)
-    globalParams->setErrQuiet(quiet);
-
-  #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
-    std::optional<GooString> ownerPW, userPW;
-  #else
-    GooString *ownerPW, *userPW;
-  #endif
-  if (ownerPassword[0]) {
-    #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
-      ownerPW = GooString(ownerPassword);
-    #else
-      ownerPW = new GooString(ownerPassword);
-    #endif
-  } else {
-    #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
-      ownerPW = std::nullopt;
-    #else
-      ownerPW = 0;
-    #endif
+// Convert all files listed in the manifest ("-" for standard input).
+// Each line holds the name of a PDF file, optionally followed by a tab
+// and the name of the Ipe file.  Empty lines and lines starting with
+// '#' are ignored.  The outcome of every file is reported on stderr.
+static int convertBatch(const char *manifest)
+{
+  FILE *f = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+  if (!f) {
+    fprintf(stderr, "Couldn't open manifest '%s'\n", manifest);
+    return 1;
   }
-  if (userPassword[0]) {
-    #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
-      userPW = GooString(userPassword);
-    #else
-      userPW = new GooString(userPassword);
-    #endif
-  } else {
-    #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
-      userPW = std::nullopt;
-    #else
-      userPW = 0;
-    #endif
+  int exitCode = 0;
+  int numFiles = 0, numFailed = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::string line;
+  while (readLine(f, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    size_t tab = line.find('\t');
+    std::string pdfName = line.substr(0, tab);
+    std::string xmlName = (tab == std::string::npos) ?
+      defaultXmlFileName(pdfName) : line.substr(tab + 1);
+    auto fileStart = std::chrono::steady_clock::now();
+    PdfInput input;
+    input.fileName = pdfName;
+    int result = convertFile(input, xmlName, options);
+    ++numFiles;
+    if (result) {
+      ++numFailed;
+      exitCode = std::max(exitCode, result);
+      fprintf(stderr, "FAILED %s (%s, %.3fs)\n", pdfName.c_str(),
+	      exitCodeMessage(result),
+	      secondsSince(fileStart));
+    } else
+      fprintf(stderr, "OK %s -> %s (%.3fs)\n", pdfName.c_str(),
+	      xmlName.c_str(), secondsSince(fileStart));
   }
+  if (f != stdin)
+    fclose(f);
+  fprintf(stderr, "Converted %d of %d files in %.3fs\n",
+	  numFiles - numFailed, numFiles, secondsSince(start));
+  return exitCode;
+}
 
-    // open PDF file
-    #if POPPLER_VERSION_AT_LEAST(22, 3, 0)
-      PDFDoc *doc = new PDFDoc(std::make_unique<GooString>(fileName->c_str()), ownerPW, userPW);
-    #else
-      PDFDoc *doc = new PDFDoc(fileName, ownerPW, userPW);
-      delete userPW;
-      delete ownerPW;
-    #endif
+// Returns false if an option is out of range.
+static bool validOptions(const ConvertOptions &opts)
+{
+  return opts.precision >= -1 && opts.precision <= XmlWriter::kMaxDecimals;
+}
 
-  if (!doc->isOk())
+// Parse the arguments of a server job into jobOptions.  Only
+// conversion options are allowed, no file names or other modes, and
+// no -j, as the jobs already run in parallel.
+static bool parseJobOptions(const std::vector<std::string> &args,
+			    ConvertOptions &jobOptions)
+{
+  ConvertOptions opts = jobOptions;
+  std::vector<ArgDesc> argDesc = optionArgs(opts);
+  argDesc.erase(std::remove_if(argDesc.begin(), argDesc.end(),
+			       [](const ArgDesc &a) {
+				 return !strcmp(a.arg, "-j"); }),
+		argDesc.end());
+  argDesc.push_back({NULL, argFlag, 0, 0, 0});
+  std::vector<std::string> strings(args);
+  std::vector<char *> argv;
+  argv.push_back(const_cast<char *>("pdftoipe"));
+  for (auto &s : strings)
+    argv.push_back(&s[0]);
+  argv.push_back(nullptr);
+  int argc = argv.size() - 1;
+  if (!parseArgs(argDesc.data(), &argc, argv.data()) || argc != 1
+      || !validOptions(opts))
+    return false;
+  jobOptions = opts;
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  // parse args
+  std::vector<ArgDesc> argDesc = commandArgs();
+  bool ok = parseArgs(argDesc.data(), &argc, argv);
+  bool batch = batchFile[0] != '\0';
+  bool serve = serveSocket[0] != '\0';
+  bool noFiles = batch || serve;
+  if (!ok || printHelp || (batch && serve) || !validOptions(options)
+      || (noFiles ? argc != 1 : (argc < 2 || argc > 3))) {
+    fprintf(stderr, "pdftoipe version %s\n", PDFTOIPE_VERSION);
+    printUsage("pdftoipe", "<PDF-file> [<XML-file>]", argDesc.data());
     return 1;
-  
-  // construct XML file name
-  std::string xmlFileName;
-  if (argc == 3) {
-    xmlFileName = argv[2];
-  } else {
-    #if POPPLER_VERSION_AT_LEAST(25, 10, 0)
-      const size_t fileSize = fileName->size();
-    #else
-      const size_t fileSize = fileName->getLength();
-    #endif
-    const char *p = fileName->c_str() + fileSize - 4;
-    if (!strcmp(p, ".pdf") || !strcmp(p, ".PDF")) {
-        xmlFileName = std::string(fileName->c_str(),
-                                  fileSize - 4);
-    } else {
-      xmlFileName = fileName->c_str();
-    }
-    xmlFileName += ".ipe";
   }
 
-  // get page range
-  if (firstPage < 1)
-    firstPage = 1;
-
-  if (lastPage < 1 || lastPage > doc->getNumPages())
-    lastPage = doc->getNumPages();
-
-  // write XML file
-  XmlOutputDev *xmlOut = 
-    new XmlOutputDev(xmlFileName, doc->getXRef(),
-                     doc->getCatalog(), firstPage, lastPage);
-
-  // tell output device about text handling
-  xmlOut->setTextHandling(math, notext, literal, mergeLevel, noTextSize, unicodeLevel);
-  
-  int exitCode = 2;
-  if (xmlOut->isOk()) {
-    doc->displayPages(xmlOut, firstPage, lastPage, 
-		      // double hDPI, double vDPI, int rotate,
-		      // bool useMediaBox, bool crop, bool printing,
-		      72.0, 72.0, 0, false, false, false);
-    exitCode = 0;
-  }
+  // GlobalParams and its font caches are shared by all files
+  initConverter(options.quiet);
 
-  if (xmlOut->hasUnicode()) {
-    fprintf(stderr, "The document contains Unicode (non-ASCII) text.\n");
-    if (unicodeLevel <= 1)
-      fprintf(stderr, "Unknown Unicode characters were replaced by [U+XXX].\n");
-    else
-      fprintf(stderr, "UTF-8 was set as document encoding in the preamble.\n");
-  }
+  if (serve)
+    return runServer(serveSocket, numWorkers, options, parseJobOptions);
 
-  // clean up
-  delete xmlOut;
-  delete doc;
+  if (batch)
+    return convertBatch(batchFile);
 
-  return exitCode;
+  // construct XML file name
+  PdfInput input;
+  input.fileName = argv[1];
+  std::string xmlFileName = (argc == 3) ? std::string(argv[2]) :
+    defaultXmlFileName(argv[1]);
+
+  return convertFile(input, xmlFileName, options);
 }
 
 // --------------------------------------------------------------------
@@ -0,0 +1,72 @@
+// --------------------------------------------------------------------
+// Work-stealing page scheduler
+// --------------------------------------------------------------------
+
+#include "scheduler.h"
+
+//------------------------------------------------------------------------
+// PageScheduler
+//------------------------------------------------------------------------
+
+PageScheduler::PageScheduler(const std::vector<double> &costs,
+                             int numWorkers)
+    : iCosts(costs), iWorkers(numWorkers) {
+  double total = 0.0;
+  for (double c : iCosts)
+    total += c;
+  // a page goes to the worker whose share of the total cost contains
+  // the middle of the page
+  double sum = 0.0;
+  int w = 0;
+  for (int page = 0; page < int(iCosts.size()); ++page) {
+    double middle = sum + iCosts[page] / 2;
+    while (w < numWorkers - 1 && middle >= total * (w + 1) / numWorkers &&
+           !iWorkers[w].pages.empty())
+      ++w;
+    iWorkers[w].pages.push_back(page);
+    iWorkers[w].cost += iCosts[page];
+    sum += iCosts[page];
+  }
+}
+
+int PageScheduler::next(int worker) {
+  std::lock_guard<std::mutex> lock(iMutex);
+  Worker &self = iWorkers[worker];
+  int page;
+  if (!self.pages.empty()) {
+    page = self.pages.front();
+    self.pages.pop_front();
+    self.cost -= iCosts[page];
+  } else {
+    Worker *victim = nullptr;
+    for (Worker &other : iWorkers) {
+      if (!other.pages.empty() && (!victim || other.cost > victim->cost))
+        victim = &other;
+    }
+    if (!victim)
+      return -1;
+    page = victim->pages.back();
+    victim->pages.pop_back();
+    victim->cost -= iCosts[page];
+    ++self.stolen;
+  }
+  ++self.done;
+  return page;
+}
+
+void PageScheduler::addBusyTime(int worker, double seconds) {
+  std::lock_guard<std::mutex> lock(iMutex);
+  iWorkers[worker].busy += seconds;
+}
+
+void PageScheduler::report(FILE *f, double seconds) const {
+  std::lock_guard<std::mutex> lock(iMutex);
+  for (int w = 0; w < int(iWorkers.size()); ++w) {
+    const Worker &worker = iWorkers[w];
+    fprintf(f, "Thread %d: %d pages (%d stolen), busy %.2fs (%.0f%%)\n", w + 1,
+            worker.done, worker.stolen, worker.busy,
+            seconds > 0.0 ? 100.0 * worker.busy / seconds : 0.0);
+  }
+}
+
+// --------------------------------------------------------------------
@@ -0,0 +1,52 @@
+// -*- C++ -*-
+// --------------------------------------------------------------------
+// Scheduler.h
+// --------------------------------------------------------------------
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdio.h>
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Work-stealing distribution of pages to conversion threads.
+//
+// Every worker starts with a contiguous range of pages of about equal
+// estimated cost, and converts them from the front.  A worker that
+// runs out of pages steals from the back of the queue with the
+// largest remaining cost, so pages are still mostly completed in
+// document order.
+class PageScheduler {
+public:
+  // Pages are numbered 0 .. costs.size() - 1.
+  PageScheduler(const std::vector<double> &costs, int numWorkers);
+
+  // Return the next page for worker, or -1 if there is none left.
+  int next(int worker);
+
+  // Record that worker spent seconds converting a page.
+  void addBusyTime(int worker, double seconds);
+
+  // Print pages and utilisation of each worker, given the wall-clock
+  // time of the whole conversion.
+  void report(FILE *f, double seconds) const;
+
+private:
+  struct Worker {
+    std::deque<int> pages;
+    double cost = 0.0; // estimated cost of pages in queue
+    int done = 0;      // number of pages handed out
+    int stolen = 0;    // number of pages stolen from others
+    double busy = 0.0; // seconds spent converting
+  };
+
+  std::vector<double> iCosts;
+  std::vector<Worker> iWorkers;
+  mutable std::mutex iMutex;
+};
+
+// --------------------------------------------------------------------
+#endif
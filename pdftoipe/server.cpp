@@ -0,0 +1,308 @@
+// --------------------------------------------------------------------
+// Conversion server on a Unix domain socket
+// --------------------------------------------------------------------
+
+#include "server.h"
+
+#include <stdio.h>
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Longest request line, and largest PDF file accepted as data.
+static const size_t MAX_LINE_LENGTH = 1 << 16;
+static const size_t MAX_DATA_LENGTH = size_t(1) << 30;
+
+//------------------------------------------------------------------------
+// Connection
+//------------------------------------------------------------------------
+
+// Buffered reading and writing on the socket of one job.
+class Connection {
+public:
+  explicit Connection(int fd) : iFd(fd), iPos(0), iEnd(0) {}
+  ~Connection() { close(iFd); }
+
+  // Read a line without the line break.
+  bool readLine(std::string &line);
+  // Read exactly len bytes.
+  bool readData(std::string &data, size_t len);
+  bool write(const char *s, size_t len);
+  bool write(const std::string &s) { return write(s.data(), s.size()); }
+
+private:
+  bool fill();
+
+private:
+  int iFd;
+  char iBuffer[1 << 16];
+  size_t iPos;
+  size_t iEnd;
+};
+
+bool Connection::fill() {
+  ssize_t n;
+  do {
+    n = read(iFd, iBuffer, sizeof(iBuffer));
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return false;
+  iPos = 0;
+  iEnd = n;
+  return true;
+}
+
+bool Connection::readLine(std::string &line) {
+  line.clear();
+  for (;;) {
+    if (iPos == iEnd && !fill())
+      return false;
+    char *p = (char *)memchr(iBuffer + iPos, '\n', iEnd - iPos);
+    size_t n = (p ? p - iBuffer : iEnd) - iPos;
+    line.append(iBuffer + iPos, n);
+    iPos += n;
+    if (p) {
+      ++iPos;
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      return true;
+    }
+    if (line.size() > MAX_LINE_LENGTH)
+      return false;
+  }
+}
+
+bool Connection::readData(std::string &data, size_t len) {
+  data.clear();
+  data.reserve(len);
+  while (data.size() < len) {
+    if (iPos == iEnd && !fill())
+      return false;
+    size_t n = std::min(iEnd - iPos, len - data.size());
+    data.append(iBuffer + iPos, n);
+    iPos += n;
+  }
+  return true;
+}
+
+bool Connection::write(const char *s, size_t len) {
+  while (len > 0) {
+    ssize_t n = ::write(iFd, s, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    s += n;
+    len -= n;
+  }
+  return true;
+}
+
+// --------------------------------------------------------------------
+
+static void replyError(Connection &conn, int code, const char *message) {
+  std::string reply = "error " + std::to_string(code) + " " + message + "\n";
+  conn.write(reply);
+}
+
+// Read the request from the client, convert, and send the reply.
+static void handleJob(int fd, const ConvertOptions &defaults,
+                      JobOptionParser parser) {
+  Connection conn(fd);
+  std::vector<std::string> args;
+  PdfInput input;
+  std::string data, output, line;
+  bool hasData = false;
+  size_t dataLength = 0;
+  for (;;) {
+    if (!conn.readLine(line))
+      return; // client went away
+    if (line.empty())
+      break;
+    size_t space = line.find(' ');
+    std::string key = line.substr(0, space);
+    std::string value =
+        (space == std::string::npos) ? std::string() : line.substr(space + 1);
+    if (key == "arg")
+      args.push_back(value);
+    else if (key == "input")
+      input.fileName = value;
+    else if (key == "output")
+      output = value;
+    else if (key == "data") {
+      char *end;
+      dataLength = strtoull(value.c_str(), &end, 10);
+      if (value.empty() || *end || dataLength > MAX_DATA_LENGTH) {
+        replyError(conn, 3, "invalid data length");
+        return;
+      }
+      hasData = true;
+    } else {
+      replyError(conn, 3, "unknown request");
+      return;
+    }
+  }
+
+  if (hasData) {
+    if (!conn.readData(data, dataLength))
+      return;
+    input.data = data.data();
+    input.size = data.size();
+  } else if (input.fileName.empty()) {
+    replyError(conn, 3, "no input");
+    return;
+  }
+  if (output == "-") {
+    replyError(conn, 3, "cannot write to standard output");
+    return;
+  }
+
+  ConvertOptions options = defaults;
+  if (!parser(args, options)) {
+    replyError(conn, 3, "invalid arguments");
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::string xml;
+  int result = output.empty() ? convertToString(input, xml, options)
+                              : convertFile(input, output, options);
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  const char *name = hasData ? "<data>" : input.fileName.c_str();
+  if (result) {
+    fprintf(stderr, "FAILED %s (%.3fs)\n", name, seconds);
+    replyError(conn, result, exitCodeMessage(result));
+    return;
+  }
+  fprintf(stderr, "OK %s (%.3fs)\n", name, seconds);
+  std::string header = "ok " + std::to_string(xml.size()) + "\n";
+  if (conn.write(header))
+    conn.write(xml);
+}
+
+//------------------------------------------------------------------------
+// Server
+//------------------------------------------------------------------------
+
+int runServer(const char *socketPath, int numWorkers, ConvertOptions defaults,
+              JobOptionParser parser) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path '%s' is too long\n", socketPath);
+    return 1;
+  }
+  strcpy(addr.sun_path, socketPath);
+
+  // a socket left over from an earlier run is replaced, anything else
+  // at that path is kept
+  struct stat st;
+  if (lstat(socketPath, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "'%s' exists and is not a socket\n", socketPath);
+      return 1;
+    }
+    unlink(socketPath);
+  }
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    perror("socket");
+    return 1;
+  }
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock, SOMAXCONN) < 0) {
+    fprintf(stderr, "Couldn't listen on '%s': %s\n", socketPath,
+            strerror(errno));
+    close(sock);
+    return 1;
+  }
+
+  // a client closing its connection early must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  if (numWorkers < 1)
+    numWorkers = std::max(1u, std::thread::hardware_concurrency());
+  fprintf(stderr, "Listening on '%s' with %d workers\n", socketPath,
+          numWorkers);
+
+  // accepted connections wait here for a worker; when the queue is
+  // full, new connections wait in the listen backlog
+  const size_t maxQueued = 4 * numWorkers;
+  std::deque<int> queue;
+  std::mutex mutex;
+  std::condition_variable jobAdded, jobTaken;
+
+  auto worker = [&]() {
+    for (;;) {
+      int fd;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobAdded.wait(lock, [&] { return !queue.empty(); });
+        fd = queue.front();
+        queue.pop_front();
+      }
+      jobTaken.notify_one();
+      handleJob(fd, defaults, parser);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (int i = 0; i < numWorkers; ++i)
+    workers.emplace_back(worker);
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      jobTaken.wait(lock, [&] { return queue.size() < maxQueued; });
+    }
+    int fd = accept(sock, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept");
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+          errno == ENOMEM) {
+        // out of resources, wait for running jobs to release some
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        continue;
+      }
+      // the workers still use the queue, so don't unwind this frame
+      exit(1);
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(fd);
+    }
+    jobAdded.notify_one();
+  }
+}
+
+#else
+
+// there are no Unix domain sockets to listen on
+int runServer(const char *, int, ConvertOptions, JobOptionParser) {
+  fprintf(stderr, "The conversion server is not available on Windows\n");
+  return 1;
+}
+
+#endif
+
+// --------------------------------------------------------------------
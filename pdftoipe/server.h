@@ -0,0 +1,46 @@
+// -*- C++ -*-
+// --------------------------------------------------------------------
+// Server.h
+// --------------------------------------------------------------------
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <vector>
+
+#include "converter.h"
+
+// Parse the command line arguments of a job into options, which
+// already hold the defaults.  Returns false if the arguments are
+// invalid.
+typedef bool (*JobOptionParser)(const std::vector<std::string> &args,
+                                ConvertOptions &options);
+
+// Accept conversion jobs on a Unix domain socket, and convert them
+// with at most numWorkers jobs running at the same time.  Returns
+// only if the socket cannot be set up, and exits the program on fatal
+// errors later on.  On Windows, which has no such sockets, it fails at
+// once.
+//
+// Every connection carries one job.  The client sends request lines,
+// terminated by an empty line:
+//
+//   arg <argument>   one command line argument, such as "-merge"
+//   input <path>     the PDF file to convert
+//   data <length>    or: the PDF file follows the empty line
+//   output <path>    write the Ipe file here instead of replying with it
+//
+// The server replies with "ok <length>", a newline, and <length> bytes
+// of Ipe XML (zero bytes if an output path was given), or with
+// "error <code> <message>" and a newline.  The code is the exit code
+// pdftoipe would have returned, or 3 if the request or its arguments
+// are invalid.  A job cannot set -j.
+//
+// The workers share a copy of the defaults, which the parser of a job
+// must not change.
+int runServer(const char *socketPath, int numWorkers, ConvertOptions defaults,
+              JobOptionParser parser);
+
+// --------------------------------------------------------------------
+#endif
@@ -0,0 +1,17 @@
+// -*- C++ -*-
+// --------------------------------------------------------------------
+// Sha256.h
+// --------------------------------------------------------------------
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+
+#include <string>
+
+// The SHA-256 digest of the data, as 32 bytes.
+std::string sha256(const char *data, size_t len);
+
+// --------------------------------------------------------------------
+#endif
@@ -0,0 +1,112 @@
+// --------------------------------------------------------------------
+// Simplification of polylines
+// --------------------------------------------------------------------
+
+#include "simplify.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <utility>
+
+// Largest number of vertices replaced by one segment, which bounds the
+// time spent on a vertex.
+#define MAX_RUN 256
+
+// Distance of p from the segment ab.
+static double segmentDistance(const PathPoint &p, const PathPoint &a,
+                              const PathPoint &b) {
+  double dx = b.x - a.x;
+  double dy = b.y - a.y;
+  double len2 = dx * dx + dy * dy;
+  double t = 0.0;
+  if (len2 > 0) {
+    t = ((p.x - a.x) * dx + (p.y - a.y) * dy) / len2;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+  }
+  return hypot(p.x - a.x - t * dx, p.y - a.y - t * dy);
+}
+
+// Largest distance of the vertices between a and b from the segment
+// ab.
+static double rangeDistance(const std::vector<PathPoint> &points, int a,
+                            int b) {
+  double d = 0.0;
+  for (int k = a + 1; k < b; ++k)
+    d = std::max(d, segmentDistance(points[k], points[a], points[b]));
+  return d;
+}
+
+void simplifyPolyline(std::vector<PathPoint> &points, double tolerance) {
+  if (points.size() < 3)
+    return;
+
+  // vertices on the straight line between their neighbours
+  size_t kept = 1;
+  for (size_t i = 1; i + 1 < points.size(); ++i) {
+    const PathPoint &a = points[kept - 1];
+    const PathPoint &p = points[i];
+    const PathPoint &b = points[i + 1];
+    double cross = (p.x - a.x) * (b.y - a.y) - (p.y - a.y) * (b.x - a.x);
+    double dot = (p.x - a.x) * (b.x - p.x) + (p.y - a.y) * (b.y - p.y);
+    if (cross == 0 && dot >= 0)
+      continue;
+    points[kept++] = p;
+  }
+  points[kept++] = points.back();
+  points.resize(kept);
+
+  int n = points.size();
+  if (n < 3 || tolerance <= 0)
+    return;
+
+  // the distance of a vertex is the largest distance of the vertices
+  // removed with it from the segment replacing them; a heap entry is
+  // stale if the vertex has been removed or its distance has changed
+  // since
+  std::vector<int> prev(n), next(n);
+  std::vector<double> dist(n, 0.0);
+  std::vector<bool> removed(n, false);
+  typedef std::pair<double, int> Entry;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+  for (int i = 0; i < n; ++i) {
+    prev[i] = i - 1;
+    next[i] = i + 1;
+    if (i > 0 && i < n - 1) {
+      dist[i] = segmentDistance(points[i], points[i - 1], points[i + 1]);
+      if (dist[i] <= tolerance)
+        heap.push(Entry(dist[i], i));
+    }
+  }
+  while (!heap.empty()) {
+    Entry e = heap.top();
+    heap.pop();
+    int i = e.second;
+    if (removed[i] || e.first != dist[i])
+      continue;
+    removed[i] = true;
+    next[prev[i]] = next[i];
+    prev[next[i]] = prev[i];
+    for (int k : {prev[i], next[i]}) {
+      if (k == 0 || k == n - 1)
+        continue;
+      if (next[k] - prev[k] > MAX_RUN) {
+        dist[k] = HUGE_VAL; // kept, and its entries are stale
+        continue;
+      }
+      dist[k] = rangeDistance(points, prev[k], next[k]);
+      if (dist[k] <= tolerance)
+        heap.push(Entry(dist[k], k));
+    }
+  }
+
+  kept = 0;
+  for (int i = 0; i < n; ++i) {
+    if (!removed[i])
+      points[kept++] = points[i];
+  }
+  points.resize(kept);
+}
+
+// --------------------------------------------------------------------
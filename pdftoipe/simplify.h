@@ -0,0 +1,28 @@
+// -*- C++ -*-
+// --------------------------------------------------------------------
+// Simplify.h
+// --------------------------------------------------------------------
+
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include <vector>
+
+struct PathPoint {
+  double x, y;
+};
+
+// Remove the vertices of a polyline that lie within tolerance of the
+// segment between their neighbours, keeping both end points.  No
+// removed vertex ends up farther than tolerance from the result.
+//
+// Collinear vertices are removed first, in a single pass.  The others
+// are removed in the order of their distance, as in the algorithm of
+// Visvalingam and Whyatt, using a heap.  The distance of a vertex is
+// that of all vertices removed between its remaining neighbours from
+// the segment joining them.  A segment replaces at most a few hundred
+// vertices, so the time is O(n log n).
+void simplifyPolyline(std::vector<PathPoint> &points, double tolerance);
+
+// --------------------------------------------------------------------
+#endif
@@ -0,0 +1,91 @@
+// --------------------------------------------------------------------
+// Assembly of glyphs into lines of text
+// --------------------------------------------------------------------
+
+#include "textlayout.h"
+
+#include <algorithm>
+#include <numeric>
+
+// Distances relative to the font size: baselines closer than this are
+// the same, gaps wider than SPACE_WIDTH separate words, and gaps wider
+// than COLUMN_GAP, or glyphs going back by more than OVERLAP, start a
+// new line.
+#define BASELINE_TOLERANCE 0.2
+#define SPACE_WIDTH 0.15
+#define COLUMN_GAP 2.0
+#define OVERLAP 0.5
+
+//------------------------------------------------------------------------
+// TextLayout
+//------------------------------------------------------------------------
+
+std::vector<TextLayout::Line> TextLayout::takeLines() {
+  int n = iGlyphs.size();
+  std::vector<double> along(n), across(n);
+  for (int i = 0; i < n; ++i) {
+    const Glyph &g = iGlyphs[i];
+    along[i] = g.ux * g.x + g.uy * g.y;
+    across[i] = g.ux * g.y - g.uy * g.x;
+  }
+
+  // the sorted order is the index: a line is a contiguous range
+  std::vector<int> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    if (iGlyphs[a].style != iGlyphs[b].style)
+      return iGlyphs[a].style < iGlyphs[b].style;
+    if (across[a] != across[b])
+      return across[a] < across[b];
+    return a < b;
+  });
+
+  std::vector<Line> lines;
+  std::vector<int> firsts; // first glyph drawn of each line
+  auto byPosition = [&](int a, int b) {
+    return along[a] < along[b] || (along[a] == along[b] && a < b);
+  };
+  int i = 0;
+  while (i < n) {
+    const Glyph &g = iGlyphs[order[i]];
+    int j = i + 1;
+    while (j < n && iGlyphs[order[j]].style == g.style &&
+           across[order[j]] - across[order[i]] <= BASELINE_TOLERANCE * g.em)
+      ++j;
+    std::sort(order.begin() + i, order.begin() + j, byPosition);
+    int prev = -1;
+    for (int k = i; k < j; ++k) {
+      int cur = order[k];
+      const Glyph &c = iGlyphs[cur];
+      double gap = 0.0;
+      if (prev >= 0)
+        gap = along[cur] - along[prev] - iGlyphs[prev].advance;
+      if (prev < 0 || gap > COLUMN_GAP * c.em || gap < -OVERLAP * c.em) {
+        lines.push_back(Line{c.style, c.x, c.y, c.text});
+        firsts.push_back(cur);
+      } else {
+        std::string &text = lines.back().text;
+        if (gap > SPACE_WIDTH * c.em && !text.empty() &&
+            text.back() != ' ' && !c.text.empty() && c.text.front() != ' ')
+          text += ' ';
+        text += c.text;
+        firsts.back() = std::min(firsts.back(), cur);
+      }
+      prev = cur;
+    }
+    i = j;
+  }
+
+  std::vector<int> byFirst(lines.size());
+  std::iota(byFirst.begin(), byFirst.end(), 0);
+  std::sort(byFirst.begin(), byFirst.end(),
+            [&](int a, int b) { return firsts[a] < firsts[b]; });
+  std::vector<Line> result;
+  result.reserve(lines.size());
+  for (int l : byFirst)
+    result.push_back(std::move(lines[l]));
+  iGlyphs.clear();
+  return result;
+}
+
+// --------------------------------------------------------------------
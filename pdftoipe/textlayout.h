@@ -0,0 +1,48 @@
+// -*- C++ -*-
+// --------------------------------------------------------------------
+// TextLayout.h
+// --------------------------------------------------------------------
+
+#ifndef TEXTLAYOUT_H
+#define TEXTLAYOUT_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Assembly of the glyphs of a page into lines of text.
+//
+// Glyphs of the same style whose baselines agree are sorted along the
+// baseline.  A gap between two glyphs becomes a space if it is wide
+// enough, and starts a new line if it is wider still, like the gap
+// between two columns.
+class TextLayout {
+public:
+  struct Glyph {
+    double x, y;   // origin on the baseline
+    double ux, uy; // unit vector along the baseline
+    double advance; // along the baseline
+    double em;      // font size
+    int style;      // only glyphs of the same style form a line
+    std::string text;
+  };
+
+  struct Line {
+    int style;
+    double x, y; // origin of the first glyph
+    std::string text;
+  };
+
+  void addGlyph(Glyph &&glyph) { iGlyphs.push_back(std::move(glyph)); }
+  bool empty() const { return iGlyphs.empty(); }
+
+  // Return the lines in the order their first glyphs were added, and
+  // forget the glyphs.
+  std::vector<Line> takeLines();
+
+private:
+  std::vector<Glyph> iGlyphs;
+};
+
+// --------------------------------------------------------------------
+#endif
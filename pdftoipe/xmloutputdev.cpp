@@ -2,23 +2,30 @@
 // Output device writing XML stream
 // --------------------------------------------------------------------
 
-#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 
 #include <string>
 
 #include "Catalog.h"
+#include "Dict.h"
 #include "Error.h"
 #include "Gfx.h"
 #include "GfxFont.h"
 #include "GfxState.h"
 #include "Object.h"
+#include "PDFDoc.h"
 #include "Page.h"
 #include "Stream.h"
+#include "XRef.h"
 
 #include "xmloutputdev.h"
+#include "xmlwriter.h"
+#include "deflater.h"
+#include "simplify.h"
+#include "sha256.h"
 
+#include <algorithm>
 #include <cmath>
 #include <vector>
 
@@ -30,27 +37,32 @@ XmlOutputDev::XmlOutputDev(const std::string &fileName, XRef *xrefA,
                            Catalog *catalog, int firstPage, int lastPage) {
   FILE *f;
 
-  if (!(f = fopen(fileName.c_str(), "wb"))) {
+  initialize(xrefA);
+
+  if (fileName == "-")
+    f = stdout;
+  else if (!(f = fopen(fileName.c_str(), "wb"))) {
     fprintf(stderr, "Couldn't open output file '%s'\n", fileName.c_str());
     ok = false;
     return;
   }
   outputStream = f;
+  iDoc = new XmlWriter(f);
+  iOut = iDoc;
+  writeProlog(catalog, firstPage);
+}
 
-  // initialize
-  ok = true;
-  xref = xrefA;
-  inText = false;
-  iUnicode = false;
-
-  // set defaults
-  iIsMath = false;
-  iNoText = false;
-  iIsLiteral = false;
-  iMergeLevel = 0;
-  iUnicodeLevel = 1;
+XmlOutputDev::XmlOutputDev(const XmlWriter::Sink &sink, XRef *xrefA,
+                           Catalog *catalog, int firstPage, int lastPage) {
+  initialize(xrefA);
+  iDoc = new XmlWriter(sink);
+  iOut = iDoc;
+  writeProlog(catalog, firstPage);
+}
 
-  Page *page = catalog->getPage(firstPage);
+// Write the XML header and a style sheet with the layout of the page.
+void XmlOutputDev::writeProlog(Catalog *catalog, int pageNum) {
+  Page *page = catalog->getPage(pageNum);
   double wid = page->getMediaWidth();
   double ht = page->getMediaHeight();
 
@@ -74,16 +86,72 @@ XmlOutputDev::XmlOutputDev(const std::string &fileName, XRef *xrefA,
 
   writePS("<?xml version=\"1.0\"?>\n");
   writePS("<!DOCTYPE ipe SYSTEM \"ipe.dtd\">\n");
-  writePSFmt("<ipe version=\"70000\" creator=\"pdftoipe %s\">\n",
-             PDFTOIPE_VERSION);
+  writePS("<ipe version=\"70000\" creator=\"pdftoipe " PDFTOIPE_VERSION
+          "\">\n");
   writePS("<ipestyle>\n");
-  writePSFmt("<layout paper=\"%g %g\" frame=\"%g %g\" origin=\"%g %g\"/>\n",
-             wid, ht, crop->x2 - crop->x1, crop->y2 - crop->y1,
-             crop->x1 - media->x1, crop->y1 - media->y1);
+  writePS("<layout paper=\"");
+  writeCoords(wid, ht);
+  writePS("\" frame=\"");
+  writeCoords(crop->x2 - crop->x1, crop->y2 - crop->y1);
+  writePS("\" origin=\"");
+  writeCoords(crop->x1 - media->x1, crop->y1 - media->y1);
+  writePS("\"/>\n");
   writePS("<symbol name=\"bullet\"><path matrix=\"0.04 0 0 0.04 0 0\" "
           "fill=\"black\">\n");
   writePS("18 0 0 18 0 0 e</path></symbol>\n");
   writePS("</ipestyle>\n");
+}
+
+XmlOutputDev::XmlOutputDev(std::string &pages, XRef *xrefA, int seqPageA) {
+  initialize(xrefA);
+  iFragment = true;
+  iDoc = new XmlWriter(pages);
+  iOut = iDoc;
+  seqPage = seqPageA;
+}
+
+void XmlOutputDev::initialize(XRef *xrefA) {
+  ok = true;
+  xref = xrefA;
+  outputStream = nullptr;
+  iDoc = nullptr;
+  iOut = nullptr;
+  iFragment = false;
+  inText = false;
+  iUnicode = false;
+
+  // set defaults
+  iIsMath = false;
+  iNoText = false;
+  iIsLiteral = false;
+  iMergeLevel = 0;
+  iUnicodeLevel = 1;
+  iBase64 = false;
+  iFlateLevel = 0;
+  iDeflater = nullptr;
+  iShareBitmaps = false;
+  iSpoolFile = nullptr;
+  iSpool = nullptr;
+  iNumBitmaps = 0;
+  iInBitmap = false;
+  iHasFill = false;
+  iGradients = false;
+  iNumGradients = 0;
+  iPatterns = false;
+  iNumSymbols = 0;
+  iFormDoc = nullptr;
+  iState = nullptr;
+  iPathOut = new XmlWriter(iPathText);
+  iSymbolThreshold = 0;
+  iSimplifyTolerance = 0;
+  iStartOut = new XmlWriter(iPathStart);
+  iPathReturn = nullptr;
+  iCaptureDepth = 0;
+  iTextClip = false;
+  iPalette = false;
+  iPenTolerance = 0;
+  iPenOut = new XmlWriter(iPenText);
+  iGlyphOut = new XmlWriter(iGlyphText);
 
   // initialize sequential page number
   seqPage = 1;
@@ -92,9 +160,29 @@ XmlOutputDev::XmlOutputDev(const std::string &fileName, XRef *xrefA,
 XmlOutputDev::~XmlOutputDev() {
   if (ok) {
     finishText();
-    writePS("</ipe>\n");
+    finishSpool();
+    if (!iFragment)
+      writePS("</ipe>\n");
   }
-  fclose(outputStream);
+  delete iPathOut;
+  delete iStartOut;
+  delete iGlyphOut;
+  delete iPenOut;
+  delete iDoc;
+  if (outputStream && outputStream != stdout)
+    fclose(outputStream);
+}
+
+void XmlOutputDev::appendPages(const std::string &pages, bool unicode) {
+  iOut->put(pages.data(), pages.size());
+  iUnicode = iUnicode || unicode;
+  flushPage();
+}
+
+// Hand a finished page to the reader, unless pages are being spooled.
+void XmlOutputDev::flushPage() {
+  if (!iFragment && iOut == iDoc)
+    iDoc->flush();
 }
 
 // ----------------------------------------------------------
@@ -108,17 +196,119 @@ void XmlOutputDev::setTextHandling(bool math, bool notext, bool literal,
   iMergeLevel = mergeLevel;
   iNoTextSize = noTextSize;
   iUnicodeLevel = unicodeLevel;
-  if (iUnicodeLevel >= 2) {
+  if (ok && !iFragment && iUnicodeLevel >= 2) {
     writePS("<ipestyle>\n");
     writePS("<preamble>\\usepackage[utf8]{inputenc}</preamble>\n");
     writePS("</ipestyle>\n");
   }
 }
 
+void XmlOutputDev::setImageHandling(bool base64, int flateLevel,
+                                    bool shareBitmaps) {
+  iBase64 = base64;
+  iFlateLevel = flateLevel < 9 ? flateLevel : 9;
+  iShareBitmaps = shareBitmaps;
+}
+
+void XmlOutputDev::setShadingHandling(bool gradients, bool patterns) {
+  iGradients = gradients;
+  iPatterns = patterns;
+}
+
+void XmlOutputDev::setFormHandling(PDFDoc *doc) { iFormDoc = doc; }
+
+void XmlOutputDev::setColorHandling(bool palette) { iPalette = palette; }
+
+void XmlOutputDev::setPenHandling(double tolerance) {
+  iPenTolerance = tolerance > 0 ? tolerance : 0;
+}
+
+void XmlOutputDev::setPathHandling(int symbolThreshold,
+                                   double simplifyTolerance) {
+  iSymbolThreshold = symbolThreshold > 0 ? symbolThreshold : 0;
+  iSimplifyTolerance = simplifyTolerance > 0 ? simplifyTolerance : 0;
+}
+
+void XmlOutputDev::setPrecision(int decimals) {
+  if (ok)
+    iDoc->setPrecision(decimals);
+  iPathOut->setPrecision(decimals);
+  iStartOut->setPrecision(decimals);
+  iGlyphOut->setPrecision(decimals);
+  iPenOut->setPrecision(decimals);
+}
+
+// Shared bitmaps and generated style sheet entries must come before
+// the first page that uses them.
+bool XmlOutputDev::deferPages() const {
+  return iShareBitmaps || iGradients || iPatterns || iFormDoc ||
+         iSymbolThreshold || iPalette || iPenTolerance > 0;
+}
+
+// Pages are written to a temporary file, so that bitmaps and style
+// sheet entries can be written to the document before the first page.
+void XmlOutputDev::startSpool() {
+  iSpoolFile = tmpfile();
+  if (!iSpoolFile) {
+    fprintf(stderr, "Couldn't create temporary file, not sharing bitmaps "
+                    "and not converting shadings, patterns, forms, "
+                    "repeated paths, colors or pens\n");
+    iShareBitmaps = false;
+    iGradients = false;
+    iPatterns = false;
+    iFormDoc = nullptr;
+    iSymbolThreshold = 0;
+    iPalette = false;
+    iPenTolerance = 0;
+    return;
+  }
+  iSpool = new XmlWriter(iSpoolFile);
+  iSpool->setPrecision(iDoc->precision());
+  iOut = iSpool;
+}
+
+// Append the generated style sheet and the spooled pages to the
+// document.
+void XmlOutputDev::finishSpool() {
+  if (!iSpool)
+    return;
+  delete iSpool;
+  iSpool = nullptr;
+  iOut = iDoc;
+  if (!iStyle.empty()) {
+    writePS("<ipestyle>\n");
+    iDoc->put(iStyle.data(), iStyle.size());
+    writePS("</ipestyle>\n");
+  }
+  rewind(iSpoolFile);
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), iSpoolFile)) > 0)
+    iDoc->put(buf, n);
+  fclose(iSpoolFile);
+  iSpoolFile = nullptr;
+}
+
 // ----------------------------------------------------------
 
 void XmlOutputDev::startPage(int pageNum, GfxState *state, XRef *xrefA) {
-  writePSFmt("<!-- Page: %d %d -->\n", pageNum, seqPage);
+  if (deferPages() && !iFragment && !iSpool)
+    startSpool();
+  iClip = Clip();
+  iClipStack.clear();
+  iTextClip = false;
+  iState = state;
+  iResources.clear();
+  if (iFormDoc) {
+    Page *page = iFormDoc->getPage(pageNum);
+    if (page && page->getResourceDict())
+      iResources.push_back(page->getResourceDict());
+  }
+  writePS("<!-- Page: ");
+  iOut->putInt(pageNum);
+  iOut->put(' ');
+  iOut->putInt(seqPage);
+  writePS(" -->\n");
   fprintf(stderr, "Converting page %d (numbered %d)\n", seqPage, pageNum);
   writePS("<page>\n");
   ++seqPage;
@@ -126,19 +316,158 @@ void XmlOutputDev::startPage(int pageNum, GfxState *state, XRef *xrefA) {
 
 void XmlOutputDev::endPage() {
   finishText();
+  flushFill();
+  writeTextLayout();
   writePS("</page>\n");
+  flushPage();
+  iState = nullptr;
+  iResources.clear();
 }
 
 // --------------------------------------------------------------------
 
-void XmlOutputDev::startDrawingPath() { finishText(); }
+void XmlOutputDev::startDrawingPath() {
+  finishText();
+  flushFill();
+}
 
-void XmlOutputDev::stroke(GfxState *state) {
+// Longest path, relative to its first point, that can become a symbol,
+// and how many shapes not yet symbols are counted at most.
+#define MAX_SHAPE_LENGTH 1024
+#define MAX_SHAPE_COUNTS 16384
+
+// Write the path of state to iPathText instead of the output, moved
+// by (-dx, -dy).
+void XmlOutputDev::formatPath(GfxState *state, double dx, double dy) {
+  iPathText.clear();
+  XmlWriter *out = iOut;
+  iOut = iPathOut;
+  doPath(state, dx, dy);
+  iPathOut->flush();
+  iOut = out;
+}
+
+// With path symbols, write the path of state relative to its first
+// point (iShapeX, iShapeY) to iShapeText.
+void XmlOutputDev::formatShape(GfxState *state) {
+  iShapeText.clear();
+  const GfxPath *path = state->getPath();
+  if (!iSymbolThreshold || path->getNumSubpaths() == 0)
+    return;
+  const GfxSubpath *subpath = path->getSubpath(0);
+  state->transform(subpath->getX(0), subpath->getY(0), &iShapeX, &iShapeY);
+  iPathText.swap(iShapeText);
+  formatPath(state, iShapeX, iShapeY);
+  iPathText.swap(iShapeText);
+}
+
+// Start a path object.  With path symbols, its start tag goes to
+// iPathStart first, as part of the shape.
+void XmlOutputDev::startPath() {
+  if (!iSymbolThreshold)
+    return;
+  iPathStart.clear();
+  iPathReturn = iOut;
+  iOut = iStartOut;
+}
+
+// Finish a path object with the given path.  A shape, the path
+// relative to its first point (x, y) together with the start tag, is
+// drawn as a reference to a symbol once it has been drawn often enough.
+void XmlOutputDev::finishPath(const std::string &path,
+                              const std::string &shape, double x, double y) {
+  if (iSymbolThreshold) {
+    iStartOut->flush();
+    iOut = iPathReturn;
+    if (!shape.empty() && shape.size() <= MAX_SHAPE_LENGTH) {
+      int symbol = shapeSymbol(iPathStart + shape);
+      if (symbol) {
+        writePS("<use name=\"s");
+        iOut->putInt(symbol);
+        writePS("\" pos=\"");
+        writeCoords(x, y);
+        writePS("\"/>\n");
+        return;
+      }
+    }
+    iOut->put(iPathStart.data(), iPathStart.size());
+  }
+  iOut->put(path.data(), path.size());
+  writePS("</path>\n");
+}
+
+// Count another drawing of the shape, and return its symbol once it
+// has been drawn often enough, or 0.  When too many shapes are
+// counted, those drawn once are forgotten, or all of them if that is
+// not enough, so a document of distinct paths doesn't fill memory.
+int XmlOutputDev::shapeSymbol(std::string &&key) {
+  auto it = iShapeSymbols.find(key);
+  if (it != iShapeSymbols.end())
+    return it->second;
+  int &count = iShapeCounts[key];
+  if (++count < iSymbolThreshold) {
+    if (iShapeCounts.size() > MAX_SHAPE_COUNTS) {
+      std::erase_if(iShapeCounts, [](const auto &e) { return e.second == 1; });
+      if (iShapeCounts.size() > MAX_SHAPE_COUNTS / 2)
+        iShapeCounts.clear();
+    }
+    return 0;
+  }
+  iShapeCounts.erase(key);
+  int symbol = defineSymbol(key + "</path>\n");
+  iShapeSymbols.emplace(std::move(key), symbol);
+  return symbol;
+}
+
+// A fill is held back until the next object is drawn: PDF's "B"
+// operator fills and then strokes the same path, and both go into a
+// single Ipe path object.
+void XmlOutputDev::holdFill(GfxState *state, bool evenOdd) {
   startDrawingPath();
+  state->getFillRGB(&iFillColor);
+  iFillEvenOdd = evenOdd;
+  formatShape(state);
+  iFillShape.swap(iShapeText);
+  iFillX = iShapeX;
+  iFillY = iShapeY;
+  formatPath(state);
+  iFillPath.swap(iPathText);
+  iHasFill = true;
+}
+
+void XmlOutputDev::flushFill() {
+  if (!iHasFill)
+    return;
+  iHasFill = false;
+  startPath();
+  writeColor("<path fill=", iFillColor,
+             iFillEvenOdd ? ">\n" : " fillrule=\"wind\">\n");
+  finishPath(iFillPath, iFillShape, iFillX, iFillY);
+}
+
+void XmlOutputDev::stroke(GfxState *state) {
+  finishText();
+  bool merge = false;
+  if (iHasFill) {
+    formatPath(state);
+    merge = (iPathText == iFillPath);
+    if (!merge)
+      flushFill();
+  } else
+    formatPath(state);
+  if (!merge)
+    formatShape(state);
   GfxRGB rgb;
   state->getStrokeRGB(&rgb);
+  startPath();
   writeColor("<path stroke=", rgb, 0);
-  writePSFmt(" pen=\"%g\"", state->getTransformedLineWidth());
+  if (merge) {
+    writeColor(" fill=", iFillColor, iFillEvenOdd ? 0 : " fillrule=\"wind\"");
+    iHasFill = false;
+  }
+  writePS(" pen=\"");
+  writePen(state->getTransformedLineWidth());
+  iOut->put('"');
 
   double start;
   int length, i;
@@ -151,47 +480,116 @@ void XmlOutputDev::stroke(GfxState *state) {
 #endif
 
   if (length) {
-    writePS(" dash=\"[");
+    std::vector<double> pattern(length);
     for (i = 0; i < length; ++i)
-#if POPPLER_VERSION_AT_LEAST(22, 9, 0)
-      writePSFmt("%g%s", state->transformWidth(dash.at(i)),
-                 (i == length - 1) ? "" : " ");
-#else
-      writePSFmt("%g%s", state->transformWidth(dash[i]),
-                 (i == length - 1) ? "" : " ");
-#endif
-    writePSFmt("] %g\"", state->transformWidth(start));
+      pattern[i] = state->transformWidth(dash[i]);
+    writePS(" dash=\"");
+    writeDash(pattern, state->transformWidth(start));
+    iOut->put('"');
   }
 
-  if (state->getLineJoin() > 0)
-    writePSFmt(" join=\"%d\"", state->getLineJoin());
-  if (state->getLineCap())
-    writePSFmt(" cap=\"%d\"", state->getLineCap());
+  if (state->getLineJoin() > 0) {
+    writePS(" join=\"");
+    iOut->putInt(state->getLineJoin());
+    iOut->put('"');
+  }
+  if (state->getLineCap()) {
+    writePS(" cap=\"");
+    iOut->putInt(state->getLineCap());
+    iOut->put('"');
+  }
 
   writePS(">\n");
-  doPath(state);
-  writePS("</path>\n");
+  if (merge)
+    finishPath(iFillPath, iFillShape, iFillX, iFillY);
+  else
+    finishPath(iPathText, iShapeText, iShapeX, iShapeY);
 }
 
-void XmlOutputDev::fill(GfxState *state) {
-  startDrawingPath();
-  GfxRGB rgb;
-  state->getFillRGB(&rgb);
-  writeColor("<path fill=", rgb, " fillrule=\"wind\">\n");
-  doPath(state);
-  writePS("</path>\n");
+// With a pen tolerance, pen widths and dash patterns are rounded to
+// multiples of it and defined in the style sheet, and strokes refer to
+// them by name.
+double XmlOutputDev::quantize(double v) const {
+  return std::round(v / iPenTolerance) * iPenTolerance;
 }
 
-void XmlOutputDev::eoFill(GfxState *state) {
-  startDrawingPath();
-  GfxRGB rgb;
-  state->getFillRGB(&rgb);
-  writeColor("<path fill=", rgb, ">\n");
-  doPath(state);
-  writePS("</path>\n");
+void XmlOutputDev::writePen(double width) {
+  if (iPenTolerance <= 0) {
+    iOut->putDouble(width);
+    return;
+  }
+  long long key = std::llround(width / iPenTolerance);
+  auto it = iPenIds.find(key);
+  int id;
+  if (it != iPenIds.end())
+    id = it->second;
+  else {
+    id = iPenIds.size() + 1;
+    iPenIds.emplace(key, id);
+    iPenText.clear();
+    iPenOut->putDouble(key * iPenTolerance);
+    iPenOut->flush();
+    iStyle += "<pen name=\"p" + std::to_string(id) + "\" value=\"" +
+              iPenText + "\"/>\n";
+  }
+  iOut->put('p');
+  iOut->putInt(id);
+}
+
+void XmlOutputDev::writeDash(const std::vector<double> &pattern,
+                             double offset) {
+  if (iPenTolerance <= 0) {
+    writeDashValue(pattern, offset);
+    return;
+  }
+  // a pattern rounded to nothing but zeros would be invalid
+  std::vector<double> rounded;
+  bool visible = false;
+  for (double d : pattern) {
+    rounded.push_back(quantize(d));
+    visible = visible || rounded.back() > 0;
+  }
+  if (!visible) {
+    writeDashValue(pattern, offset);
+    return;
+  }
+  XmlWriter *out = iOut;
+  iOut = iPenOut;
+  iPenText.clear();
+  writeDashValue(rounded, quantize(offset));
+  iPenOut->flush();
+  iOut = out;
+  auto it = iDashIds.find(iPenText);
+  int id;
+  if (it != iDashIds.end())
+    id = it->second;
+  else {
+    id = iDashIds.size() + 1;
+    iDashIds.emplace(iPenText, id);
+    iStyle += "<dashstyle name=\"d" + std::to_string(id) + "\" value=\"" +
+              iPenText + "\"/>\n";
+  }
+  iOut->put('d');
+  iOut->putInt(id);
+}
+
+void XmlOutputDev::writeDashValue(const std::vector<double> &pattern,
+                                  double offset) {
+  writePS("[");
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    if (i > 0)
+      iOut->put(' ');
+    iOut->putDouble(pattern[i]);
+  }
+  writePS("] ");
+  iOut->putDouble(offset);
 }
 
-void XmlOutputDev::doPath(GfxState *state) {
+void XmlOutputDev::fill(GfxState *state) { holdFill(state, false); }
+
+void XmlOutputDev::eoFill(GfxState *state) { holdFill(state, true); }
+
+void XmlOutputDev::doPath(GfxState *state, double dx, double dy) {
   const GfxPath *path = state->getPath();
   const GfxSubpath *subpath;
   int n, m, i, j;
@@ -203,18 +601,41 @@ void XmlOutputDev::doPath(GfxState *state) {
     subpath = path->getSubpath(i);
     m = subpath->getNumPoints();
     state->transform(subpath->getX(0), subpath->getY(0), &x, &y);
-    writePSFmt("%g %g m\n", x, y);
+    writeCoords(x - dx, y - dy);
+    writePS(" m\n");
     j = 1;
     while (j < m) {
-      if (subpath->getCurve(j)) {
+      if (iSimplifyTolerance > 0 && !subpath->getCurve(j)) {
+        // the straight segments up to the next curve, from the current point
+        iPolyline.clear();
+        iPolyline.push_back(PathPoint{x, y});
+        while (j < m && !subpath->getCurve(j)) {
+          state->transform(subpath->getX(j), subpath->getY(j), &x, &y);
+          iPolyline.push_back(PathPoint{x, y});
+          ++j;
+        }
+        simplifyPolyline(iPolyline, iSimplifyTolerance);
+        for (size_t k = 1; k < iPolyline.size(); ++k) {
+          writeCoords(iPolyline[k].x - dx, iPolyline[k].y - dy);
+          writePS(" l\n");
+        }
+      } else if (subpath->getCurve(j)) {
         state->transform(subpath->getX(j), subpath->getY(j), &x, &y);
         state->transform(subpath->getX(j + 1), subpath->getY(j + 1), &x1, &y1);
         state->transform(subpath->getX(j + 2), subpath->getY(j + 2), &x2, &y2);
-        writePSFmt("%g %g %g %g %g %g c\n", x, y, x1, y1, x2, y2);
+        writeCoords(x - dx, y - dy);
+        iOut->put(' ');
+        writeCoords(x1 - dx, y1 - dy);
+        iOut->put(' ');
+        writeCoords(x2 - dx, y2 - dy);
+        writePS(" c\n");
+        x = x2;
+        y = y2;
         j += 3;
       } else {
         state->transform(subpath->getX(j), subpath->getY(j), &x, &y);
-        writePSFmt("%g %g l\n", x, y);
+        writeCoords(x - dx, y - dy);
+        writePS(" l\n");
         ++j;
       }
     }
@@ -226,20 +647,594 @@ void XmlOutputDev::doPath(GfxState *state) {
 
 // --------------------------------------------------------------------
 
-void XmlOutputDev::updateTextPos(GfxState *) {
+// Number of samples of a shading's color function, and how far a
+// color may be off the straight line between two gradient stops.
+#define GRADIENT_SAMPLES 64
+#define GRADIENT_TOLERANCE (1.0 / 256)
+
+void XmlOutputDev::saveState(GfxState *state) {
+  iState = state;
+  iClipStack.push_back(iClip);
+}
+
+void XmlOutputDev::restoreState(GfxState *state) {
+  iState = state;
+  if (iClipStack.empty())
+    return;
+  iClip = std::move(iClipStack.back());
+  iClipStack.pop_back();
+}
+
+// The clipping paths are remembered as the outline of shaded areas and
+// pattern fills, which the outer ones clip in turn.
+void XmlOutputDev::clip(GfxState *state) {
+  if (!iGradients && !iPatterns)
+    return;
+  formatPath(state);
+  iClip.paths.emplace_back();
+  iClip.paths.back().path.swap(iPathText);
+}
+
+void XmlOutputDev::eoClip(GfxState *state) {
+  if (!iGradients && !iPatterns)
+    return;
+  formatPath(state);
+  iClip.paths.emplace_back();
+  iClip.paths.back().path.swap(iPathText);
+  iClip.paths.back().evenOdd = true;
+}
+
+// The outline of a stroke cannot be expressed, so shadings and
+// patterns are left to poppler inside this clipping region.
+void XmlOutputDev::clipToStrokePath(GfxState *) { iClip.exact = false; }
+
+bool XmlOutputDev::useShadedFills(int type) {
+  // axial and radial shadings only
+  return iGradients && !iFragment && (type == 2 || type == 3);
+}
+
+bool XmlOutputDev::axialShadedFill(GfxState *state, GfxAxialShading *shading,
+                                   double /*tMin*/, double /*tMax*/) {
+  if (!iClip.exact)
+    return false;
+  double coords[4];
+  shading->getCoords(&coords[0], &coords[1], &coords[2], &coords[3]);
+  return shadedFill(state, shading, "axial", coords, 4);
+}
+
+bool XmlOutputDev::radialShadedFill(GfxState *state,
+                                    GfxRadialShading *shading,
+                                    double /*sMin*/, double /*sMax*/) {
+  if (!iClip.exact)
+    return false;
+  double coords[6];
+  shading->getCoords(&coords[0], &coords[1], &coords[2], &coords[3],
+                     &coords[4], &coords[5]);
+  return shadedFill(state, shading, "radial", coords, 6);
+}
+
+static bool closeColors(const GfxRGB &a, const GfxRGB &b, const GfxRGB &c,
+                        double s) {
+  GfxColorComp ca[3] = {a.r, a.g, a.b};
+  GfxColorComp cb[3] = {b.r, b.g, b.b};
+  GfxColorComp cc[3] = {c.r, c.g, c.b};
+  for (int i = 0; i < 3; ++i) {
+    double mid = colToDbl(ca[i]) + s * (colToDbl(cc[i]) - colToDbl(ca[i]));
+    if (fabs(colToDbl(cb[i]) - mid) > GRADIENT_TOLERANCE)
+      return false;
+  }
+  return true;
+}
+
+// Fill the clipping region with an Ipe gradient.  The gradient's stops
+// sample the shading's color function, leaving out stops that lie on
+// the straight line between their neighbours.
+bool XmlOutputDev::shadedFill(GfxState *state, GfxUnivariateShading *shading,
+                              const char *type, const double *coords,
+                              int numCoords) {
+  GfxRGB samples[GRADIENT_SAMPLES + 1];
+  double t0 = shading->getDomain0();
+  double t1 = shading->getDomain1();
+  for (int i = 0; i <= GRADIENT_SAMPLES; ++i) {
+    GfxColor color;
+    shading->getColor(t0 + (t1 - t0) * i / GRADIENT_SAMPLES, &color);
+    shading->getColorSpace()->getRGB(&color, &samples[i]);
+  }
+
+#if POPPLER_VERSION_AT_LEAST(26, 2, 0)
+  const double *mat = state->getCTM().data();
+#else
+  const double *mat = state->getCTM();
+#endif
+
+  // the definition without its name, to find identical gradients
+  startDrawingPath();
+  iPathText.clear();
+  XmlWriter *out = iOut;
+  iOut = iPathOut;
+  writePS(" type=\"");
+  writePS(type);
+  writePS("\" extend=\"");
+  writePS(shading->getExtend0() || shading->getExtend1() ? "yes" : "no");
+  writePS("\" coords=\"");
+  for (int i = 0; i < numCoords; ++i) {
+    if (i > 0)
+      iOut->put(' ');
+    iOut->putDouble(coords[i]);
+  }
+  writePS("\" matrix=\"");
+  writeMatrix(mat);
+  writePS("\">\n");
+  // a stop ends the straight run started by the previous one
+  std::vector<int> stops(1, 0);
+  for (int i = 2; i <= GRADIENT_SAMPLES; ++i) {
+    int last = stops.back();
+    for (int j = last + 1; j < i; ++j) {
+      if (!closeColors(samples[last], samples[j], samples[i],
+                       double(j - last) / (i - last))) {
+        stops.push_back(i - 1);
+        break;
+      }
+    }
+  }
+  stops.push_back(GRADIENT_SAMPLES);
+  for (int i : stops) {
+    writePS("<stop offset=\"");
+    iOut->putDecimal(double(i) / GRADIENT_SAMPLES, 4);
+    // stops cannot use symbolic colors
+    writePS("\" color=\"");
+    writeRGB(samples[i]);
+    writePS("\"/>\n");
+  }
+  writePS("</gradient>\n");
+  iPathOut->flush();
+  iOut = out;
+
+  auto it = iGradientNames.find(iPathText);
+  int id;
+  if (it != iGradientNames.end())
+    id = it->second;
+  else {
+    id = ++iNumGradients;
+    iStyle += "<gradient name=\"g" + std::to_string(id) + "\"";
+    iStyle += iPathText;
+    iGradientNames.emplace(iPathText, id);
+  }
+
+  int groups = openClipGroups();
+  writeColor("<path fill=", samples[0], " gradient=\"g");
+  iOut->putInt(id);
+  bool evenOdd = !iClip.paths.empty() && iClip.paths.back().evenOdd;
+  writePS(evenOdd ? "\">\n" : "\" fillrule=\"wind\">\n");
+  writeClipPath(state);
+  writePS("</path>\n");
+  closeClipGroups(groups);
+  return true;
+}
+
+// Write the outline of the innermost clipping path.
+void XmlOutputDev::writeClipPath(GfxState *state) {
+  if (!iClip.paths.empty()) {
+    const std::string &path = iClip.paths.back().path;
+    iOut->put(path.data(), path.size());
+    return;
+  }
+  double xMin, yMin, xMax, yMax;
+  state->getClipBBox(&xMin, &yMin, &xMax, &yMax);
+  writeCoords(xMin, yMin);
+  writePS(" m\n");
+  writeCoords(xMax, yMin);
+  writePS(" l\n");
+  writeCoords(xMax, yMax);
+  writePS(" l\n");
+  writeCoords(xMin, yMax);
+  writePS(" l\nh\n");
+}
+
+// Open a group clipped to each clipping path but the innermost, and
+// return their number.
+int XmlOutputDev::openClipGroups() {
+  int n = int(iClip.paths.size()) - 1;
+  for (int i = 0; i < n; ++i) {
+    writePS("<group clip=\"");
+    iOut->put(iClip.paths[i].path.data(), iClip.paths[i].path.size());
+    writePS("\">\n");
+  }
+  return std::max(n, 0);
+}
+
+void XmlOutputDev::closeClipGroups(int n) {
+  for (int i = 0; i < n; ++i)
+    writePS("</group>\n");
+}
+
+// --------------------------------------------------------------------
+
+// The matrix of a followed by b.
+static void concatMatrix(const double *a, const double *b, double *m) {
+  m[0] = a[0] * b[0] + a[1] * b[2];
+  m[1] = a[0] * b[1] + a[1] * b[3];
+  m[2] = a[2] * b[0] + a[3] * b[2];
+  m[3] = a[2] * b[1] + a[3] * b[3];
+  m[4] = a[4] * b[0] + a[5] * b[2] + b[4];
+  m[5] = a[4] * b[1] + a[5] * b[3] + b[5];
+}
+
+bool XmlOutputDev::useTilingPatternFill() { return iPatterns && !iFragment; }
+
+// Draw a tiling pattern with Ipe symbols.  The cell is drawn once in
+// pattern space, and the rows and columns of tiles are built from
+// symbols holding 2^k copies of the previous ones, so the output grows
+// with the logarithm of the number of tiles only.
+bool XmlOutputDev::tilingPatternFill(GfxState *state, Gfx *gfx, Catalog *,
+                                     GfxTilingPattern *tPat, const double *mat,
+                                     int x0, int y0, int x1, int y1,
+                                     double xStep, double yStep) {
+  if (!iClip.exact)
+    return false;
+  startDrawingPath();
+  if (x1 <= x0 || y1 <= y0)
+    return true;
+
+#if POPPLER_VERSION_AT_LEAST(26, 2, 0)
+  const double *ctm = state->getCTM().data();
+#else
+  const double *ctm = state->getCTM();
+#endif
+  double savedCTM[6];
+  for (int i = 0; i < 6; ++i)
+    savedCTM[i] = ctm[i];
+
+  // the pattern matrix maps pattern space to user space
+  double m[6];
+  concatMatrix(mat, ctm, m);
+
+  // draw the cell in pattern space
+  std::string cell;
+  XmlWriter *out = startCapture(cell);
+  state->setCTM(1, 0, 0, 1, 0, 0);
+  static const double identity[6] = {1, 0, 0, 1, 0, 0};
+  gfx->drawForm(tPat->getContentStream(), tPat->getResDict(), identity,
+                tPat->getBBox());
+  endCapture(out);
+  state->setCTM(savedCTM[0], savedCTM[1], savedCTM[2], savedCTM[3],
+                savedCTM[4], savedCTM[5]);
+  if (cell.empty())
+    return true;
+
+  int cellId = defineSymbol("<group>\n" + cell + "</group>\n");
+  int row = repeatSymbol(cellId, x1 - x0, xStep, 0);
+  int tiles = repeatSymbol(row, y1 - y0, 0, yStep);
+
+  int groups = openClipGroups();
+  writePS("<group clip=\"");
+  writeClipPath(state);
+  writePS("\">\n<use name=\"s");
+  iOut->putInt(tiles);
+  writePS("\" pos=\"");
+  writeCoords(x0 * xStep, y0 * yStep);
+  writePS("\" matrix=\"");
+  writeMatrix(m);
+  writePS("\"/>\n</group>\n");
+  closeClipGroups(groups);
+  return true;
+}
+
+// --------------------------------------------------------------------
+
+// A pattern color cannot be passed on to the Gfx drawing the symbol,
+// so such forms are left to poppler.
+bool XmlOutputDev::useDrawForm() {
+  return iFormDoc && !iFragment && iState &&
+         iState->getFillColorSpace()->getMode() != csPattern &&
+         iState->getStrokeColorSpace()->getMode() != csPattern;
+}
+
+static bool getNumbers(Dict *dict, const char *key, double *v, int n) {
+  Object obj = dict->lookup(key);
+  if (!obj.isArray() || obj.arrayGetLength() != n)
+    return false;
+  for (int i = 0; i < n; ++i) {
+    Object num = obj.arrayGet(i);
+    if (!num.isNum())
+      return false;
+    v[i] = num.getNum();
+  }
+  return true;
+}
+
+// Content stream setting the graphics state inherited by a form.
+static std::string inheritedState(GfxState *state) {
+  GfxRGB fill, stroke;
+  state->getFillRGB(&fill);
+  state->getStrokeRGB(&stroke);
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%g %g %g rg %g %g %g RG %g w %d J %d j [",
+           colToDbl(fill.r), colToDbl(fill.g), colToDbl(fill.b),
+           colToDbl(stroke.r), colToDbl(stroke.g), colToDbl(stroke.b),
+           state->getLineWidth(), state->getLineCap(), state->getLineJoin());
+  std::string s = buf;
+  double start;
+#if POPPLER_VERSION_AT_LEAST(22, 9, 0)
+  std::vector<double> dash = state->getLineDash(&start);
+  for (double d : dash) {
+#else
+  double *dash;
+  int length;
+  state->getLineDash(&dash, &length, &start);
+  for (int i = 0; i < length; ++i) {
+    double d = dash[i];
+#endif
+    snprintf(buf, sizeof(buf), "%g ", d);
+    s += buf;
+  }
+  snprintf(buf, sizeof(buf), "] %g d %g Tc %g Tw %g Tz %g TL %d Tr %g Ts\n",
+           start, state->getCharSpace(), state->getWordSpace(),
+           100 * state->getHorizScaling(), state->getLeading(),
+           state->getRender(), state->getRise());
+  return s + buf;
+}
+
+// Whether a name is defined in the given subdictionary of res.
+static bool hasResource(Dict *res, const char *type, const char *name) {
+  Object dict = res->lookup(type);
+  return dict.isDict() && dict.getDict()->hasKey(name);
+}
+
+// Content stream setting the inherited font, found by name in the
+// resources of the page and the enclosing forms, or an empty string.
+// The form's own resources must not define the same name.
+std::string XmlOutputDev::inheritedFont(GfxState *state, Dict *resDict) {
+  if (!state->getFont() || !state->getFont()->getID())
+    return std::string();
+  Ref id = *state->getFont()->getID();
+  for (size_t k = iResources.size(); k-- > 0;) {
+    Object fonts = iResources[k]->lookup("Font");
+    if (!fonts.isDict())
+      continue;
+    for (int i = 0; i < fonts.dictGetLength(); ++i) {
+      const Object &font = fonts.dictGetValNF(i);
+      const char *name = fonts.dictGetKey(i);
+      if (!font.isRef() || !(font.getRef() == id))
+        continue;
+      bool hidden = resDict && hasResource(resDict, "Font", name);
+      for (size_t j = k + 1; j < iResources.size() && !hidden; ++j)
+        hidden = hasResource(iResources[j], "Font", name);
+      if (hidden)
+        continue;
+      std::string s = "/";
+      for (const char *p = name; *p; ++p) {
+        // regular characters only, the others as #xx
+        if (*p > ' ' && *p < 127 && !strchr("#%()/<>[]{}", *p))
+          s += *p;
+        else {
+          char hex[4];
+          snprintf(hex, sizeof(hex), "#%02x", (unsigned char)*p);
+          s += hex;
+        }
+      }
+      char buf[64];
+      snprintf(buf, sizeof(buf), " %g Tf\n", state->getFontSize());
+      return s + buf;
+    }
+  }
+  return std::string();
+}
+
+// Draw a form XObject as a reference to a symbol.  The symbol is the
+// form drawn in form space, starting with the inherited graphics
+// state, so a form is converted once for each state it is used in.
+// A form without resources uses those of the page and the enclosing
+// forms, so its symbol is not shared with other pages.
+void XmlOutputDev::drawForm(Ref id) {
+  Object form = xref->fetch(id.num, id.gen);
+  if (!form.isStream())
+    return;
+  Dict *dict = form.streamGetDict();
+  double bbox[4];
+  double matrix[6] = {1, 0, 0, 1, 0, 0};
+  if (!getNumbers(dict, "BBox", bbox, 4))
+    return;
+  getNumbers(dict, "Matrix", matrix, 6);
+  PDFRectangle box(std::min(bbox[0], bbox[2]), std::min(bbox[1], bbox[3]),
+                   std::max(bbox[0], bbox[2]), std::max(bbox[1], bbox[3]));
+
+  Object resObj = dict->lookup("Resources");
+  Dict *resDict = resObj.isDict() ? resObj.getDict() : nullptr;
+
+  GfxState *state = iState;
+  std::string prefix =
+      inheritedState(state) + inheritedFont(state, resDict);
+  std::string key =
+      std::to_string(id.num) + " " + std::to_string(id.gen) + " " + prefix;
+  if (!resDict) {
+    key += " page " + std::to_string(seqPage);
+    for (const Ref &r : iFormsDrawing)
+      key += " " + std::to_string(r.num) + " " + std::to_string(r.gen);
+  }
+  int symbol;
+  auto it = iFormSymbols.find(key);
+  if (it != iFormSymbols.end())
+    symbol = it->second;
+  else {
+    // like Gfx, don't draw a form inside itself
+    for (const Ref &r : iFormsDrawing) {
+      if (r == id)
+        return;
+    }
+    iFormsDrawing.push_back(id);
+    symbol = formSymbol(form.getStream(), resDict, box, prefix);
+    iFormsDrawing.pop_back();
+    iFormSymbols.emplace(key, symbol);
+  }
+  if (!symbol)
+    return;
+
+#if POPPLER_VERSION_AT_LEAST(26, 2, 0)
+  const double *ctm = state->getCTM().data();
+#else
+  const double *ctm = state->getCTM();
+#endif
+  double m[6];
+  concatMatrix(matrix, ctm, m);
+  startDrawingPath();
+  writePS("<use name=\"s");
+  iOut->putInt(symbol);
+  writePS("\" pos=\"");
+  writeCoords(box.x1, box.y1);
+  writePS("\" matrix=\"");
+  writeMatrix(m);
+  writePS("\"/>\n");
+}
+
+// Draw the form with a Gfx of its own, and return the id of its
+// symbol, or 0 if it is empty.  The Gfx places the lower left corner
+// of the bounding box at the origin.
+int XmlOutputDev::formSymbol(Stream *str, Dict *resDict,
+                             const PDFRectangle &box,
+                             const std::string &prefix) {
+  std::string content = prefix;
+#if POPPLER_VERSION_AT_LEAST(26, 1, 0)
+  str->rewind();
+#else
+  str->reset();
+#endif
+  unsigned char buf[4096];
+  int n;
+  while ((n = str->doGetChars(sizeof(buf), buf)) > 0)
+    content.append((const char *)buf, n);
+  str->close();
+
+  // the form's Gfx has its own state and clipping path
+  GfxState *state = iState;
+  Clip clip = std::move(iClip);
+  iClip = Clip();
+  std::string object;
+  XmlWriter *out = startCapture(object);
+  Object contents(
+      new MemStream(content.data(), 0, content.size(), Object(objNull)));
+  // names missing from the form's resources are looked up in those of
+  // the page and the enclosing forms, as poppler does
+  if (resDict)
+    iResources.push_back(resDict);
+  Gfx *gfx = new Gfx(iFormDoc, this,
+                     iResources.empty() ? nullptr : iResources[0], &box, &box);
+  for (size_t i = 1; i < iResources.size(); ++i)
+    gfx->pushResources(iResources[i]);
+  gfx->display(&contents);
+  delete gfx;
+  if (resDict)
+    iResources.pop_back();
+  endCapture(out);
+  iState = state;
+  iClip = std::move(clip);
+  if (object.empty())
+    return 0;
+  return defineSymbol("<group>\n" + object + "</group>\n");
+}
+
+// Send the output to s until endCapture.
+XmlWriter *XmlOutputDev::startCapture(std::string &s) {
+  startDrawingPath();
+  ++iCaptureDepth;
+  XmlWriter *out = iOut;
+  iOut = new XmlWriter(s);
+  iOut->setPrecision(out->precision());
+  return out;
+}
+
+void XmlOutputDev::endCapture(XmlWriter *out) {
+  finishText();
+  flushFill();
+  delete iOut;
+  iOut = out;
+  --iCaptureDepth;
+}
+
+// Return the symbol with count copies of symbol id, each one moved by
+// (dx, dy) from the previous one.
+int XmlOutputDev::repeatSymbol(int id, int count, double dx, double dy) {
+  // powers[k] holds 2^k copies
+  std::vector<int> powers(1, id);
+  while ((count >> powers.size()) > 0) {
+    double shift = double(1 << (powers.size() - 1));
+    std::string pair;
+    useSymbol(pair, powers.back(), 0, 0);
+    useSymbol(pair, powers.back(), shift * dx, shift * dy);
+    powers.push_back(defineSymbol("<group>\n" + pair + "</group>\n"));
+  }
+  if ((count & (count - 1)) == 0)
+    return powers.back();
+  std::string uses;
+  int offset = 0;
+  for (int k = powers.size() - 1; k >= 0; --k) {
+    if (count & (1 << k)) {
+      useSymbol(uses, powers[k], offset * dx, offset * dy);
+      offset += 1 << k;
+    }
+  }
+  return defineSymbol("<group>\n" + uses + "</group>\n");
+}
+
+// Append a reference to symbol id at (x, y) to s.
+void XmlOutputDev::useSymbol(std::string &s, int id, double x, double y) {
+  XmlWriter *out = iOut;
+  XmlWriter w(s);
+  w.setPrecision(out->precision());
+  iOut = &w;
+  writePS("<use name=\"s");
+  iOut->putInt(id);
+  writePS("\" pos=\"");
+  writeCoords(x, y);
+  writePS("\"/>\n");
+  iOut = out;
+}
+
+// Add a symbol with the given object to the style sheet, unless an
+// identical one exists already, and return its id.
+int XmlOutputDev::defineSymbol(const std::string &object) {
+  auto it = iSymbolNames.find(object);
+  if (it != iSymbolNames.end())
+    return it->second;
+  int id = ++iNumSymbols;
+  iStyle += "<symbol name=\"s" + std::to_string(id) + "\">\n";
+  iStyle += object;
+  iStyle += "</symbol>\n";
+  iSymbolNames.emplace(object, id);
+  return id;
+}
+
+// --------------------------------------------------------------------
+
+void XmlOutputDev::updateTextPos(GfxState *state) {
+  iState = state;
   if (iMergeLevel < 2)
     finishText();
 }
 
-void XmlOutputDev::updateTextShift(GfxState *, double /*shift*/) {
+void XmlOutputDev::updateTextShift(GfxState *state, double /*shift*/) {
+  iState = state;
   if (iMergeLevel < 1)
     finishText();
 }
 
+// Poppler clips to the glyphs drawn in a clipping render mode at the
+// end of the text object, which is also how text is filled with a
+// pattern.  Their outline cannot be expressed either.
+void XmlOutputDev::endTextObject(GfxState *) {
+  if (!iTextClip)
+    return;
+  iTextClip = false;
+  iClip.exact = false;
+}
+
 void XmlOutputDev::drawChar(GfxState *state, double x, double y, double dx,
                             double dy, double originX, double originY,
                             CharCode code, int nBytes, const Unicode *u,
                             int uLen) {
+  if (state->getRender() & 4)
+    iTextClip = true;
+
   // check for invisible text -- this is used by Acrobat Capture
   if ((state->getRender() & 3) == 3)
     return;
@@ -251,28 +1246,112 @@ void XmlOutputDev::drawChar(GfxState *state, double x, double y, double dx,
   if (iNoText) // discard text objects
     return;
 
+  if (iMergeLevel >= 3 && !iCaptureDepth) {
+    layoutChar(state, x - originX, y - originY, dx, dy, code, u, uLen);
+    return;
+  }
+
   startText(state, x - originX, y - originY);
+  writeChar(code, u, uLen);
+}
 
+void XmlOutputDev::writeChar(CharCode code, const Unicode *u, int uLen) {
   if (uLen == 0) {
     if (code == 0x62) {
       // this is a hack to handle bullets created by pstricks and should
       // probably be an option
       writePS("\\ipesymbol{bullet}{}{}{}");
-    } else
-      writePSFmt("[S+%02x]", code);
+    } else {
+      writePS("[S+");
+      iOut->putHex(code);
+      iOut->put(']');
+    }
   } else {
     for (int i = 0; i < uLen; ++i)
       writePSUnicode(u[i]);
   }
 }
 
+// Collect a glyph, to be assembled into lines at the end of the page.
+void XmlOutputDev::layoutChar(GfxState *state, double x, double y, double dx,
+                              double dy, CharCode code, const Unicode *u,
+                              int uLen) {
+  double M[4];
+  textMatrix(state, M);
+  XmlWriter *out = iOut;
+  iOut = iGlyphOut;
+  iGlyphText.clear();
+  writeTextStyle(state, M);
+  iGlyphOut->flush();
+  int style;
+  auto it = iTextStyleIds.find(iGlyphText);
+  if (it != iTextStyleIds.end())
+    style = it->second;
+  else {
+    style = iTextStyles.size();
+    iTextStyles.push_back(iGlyphText);
+    iTextStyleIds.emplace(iGlyphText, style);
+  }
+  iGlyphText.clear();
+  writeChar(code, u, uLen);
+  iGlyphOut->flush();
+  iOut = out;
+
+  TextLayout::Glyph g;
+  state->transform(x, y, &g.x, &g.y);
+  double len = hypot(M[0], M[1]);
+  g.ux = len > 0 ? M[0] / len : 1.0;
+  g.uy = len > 0 ? M[1] / len : 0.0;
+  double tdx, tdy;
+  state->transformDelta(dx, dy, &tdx, &tdy);
+  g.advance = g.ux * tdx + g.uy * tdy;
+  g.em = state->getFontSize() * hypot(M[2], M[3]);
+  if (!(g.em > 0))
+    g.em = 1.0;
+  g.style = style;
+  g.text = iGlyphText;
+  iLayout.addGlyph(std::move(g));
+}
+
+// Write one text object for each line assembled from the glyphs of
+// the page.
+void XmlOutputDev::writeTextLayout() {
+  for (const TextLayout::Line &line : iLayout.takeLines()) {
+    const std::string &style = iTextStyles[line.style];
+    iOut->put(style.data(), style.size());
+    writeCoords(line.x, line.y);
+    writePS("\">");
+    if (iIsMath)
+      writePS("$");
+    iOut->put(line.text.data(), line.text.size());
+    if (iIsMath)
+      writePS("$");
+    writePS("</text>\n");
+  }
+  iTextStyles.clear();
+  iTextStyleIds.clear();
+}
+
 void XmlOutputDev::startText(GfxState *state, double x, double y) {
   if (inText)
     return;
+  flushFill();
 
   double xt, yt;
   state->transform(x, y, &xt, &yt);
+  double M[4];
+  textMatrix(state, M);
+  writeTextStyle(state, M);
+  writeCoords(xt, yt);
+  writePS("\">");
+
+  if (iIsMath)
+    writePS("$");
+  inText = true;
+}
 
+// The linear part of the text matrix in device space.
+void XmlOutputDev::textMatrix(GfxState *state, double *M) {
 #if POPPLER_VERSION_AT_LEAST(26, 2, 0)
   const auto &T = state->getTextMat();
   const auto &C = state->getCTM();
@@ -290,25 +1369,31 @@ void XmlOutputDev::startText(GfxState *state, double x, double y) {
           Cp[0], Cp[1], Cp[2], Cp[3], Cp[4], Cp[5]);
   */
 
-  double M[4];
   M[0] = Cp[0] * Tp[0] + Cp[2] * Tp[1];
   M[1] = Cp[1] * Tp[0] + Cp[3] * Tp[1];
   M[2] = Cp[0] * Tp[2] + Cp[2] * Tp[3];
   M[3] = Cp[1] * Tp[2] + Cp[3] * Tp[3];
+}
 
+// Write the start tag of a text object with the current color and
+// font size, up to the position in its matrix.
+void XmlOutputDev::writeTextStyle(GfxState *state, const double *M) {
   GfxRGB rgb;
   state->getFillRGB(&rgb);
   writeColor("<text stroke=", rgb, " pos=\"0 0\" ");
   if (iNoTextSize)
     writePS("transformations=\"rigid\" ");
-  else
-    writePSFmt("transformations=\"affine\" size=\"%g\" ", state->getFontSize());
+  else {
+    writePS("transformations=\"affine\" size=\"");
+    iOut->putDouble(state->getFontSize());
+    writePS("\" ");
+  }
   writePS("valign=\"baseline\" ");
-  writePSFmt("matrix=\"%g %g %g %g %g %g\">", M[0], M[1], M[2], M[3], xt, yt);
-
-  if (iIsMath)
-    writePS("$");
-  inText = true;
+  writePS("matrix=\"");
+  writeCoords(M[0], M[1]);
+  iOut->put(' ');
+  writeCoords(M[2], M[3]);
+  iOut->put(' ');
 }
 
 void XmlOutputDev::finishText() {
@@ -322,57 +1407,90 @@ void XmlOutputDev::finishText() {
 
 // --------------------------------------------------------------------
 
+// Block size for copying image streams.
+#define RAW_CHUNK_SIZE 16384
+
+// Largest image decoded into memory by drawSoftMaskedImage.
+#define MAX_IMAGE_BUFFER (size_t(64) << 20)
+
+static void resetImageStream(ImageStream &imgStr) {
+#if POPPLER_VERSION_AT_LEAST(26, 1, 0)
+  (void)imgStr.rewind();
+#else
+  imgStr.reset();
+#endif
+}
+
+// Can the Flate-compressed data of this image be used by Ipe unchanged?
+// This requires 8-bit DeviceGray or DeviceRGB samples with the default
+// decode array, and no predictor.
+static bool isRawFlateImage(Stream *str, GfxImageColorMap *colorMap) {
+  if (str->getKind() != strFlate || colorMap->getBits() != 8)
+    return false;
+  GfxColorSpaceMode mode = colorMap->getColorSpace()->getMode();
+  if (mode != csDeviceGray && mode != csDeviceRGB)
+    return false;
+  for (int i = 0; i < colorMap->getNumPixelComps(); ++i) {
+    if (colorMap->getDecodeLow(i) != 0.0 || colorMap->getDecodeHigh(i) != 1.0)
+      return false;
+  }
+  Dict *dict = str->getDict();
+  if (!dict)
+    return false;
+  Object parms = dict->lookup("DecodeParms");
+  if (parms.isNull())
+    parms = dict->lookup("DP");
+  // with several filters, Flate is the last one
+  if (parms.isArray() && parms.arrayGetLength() > 0)
+    parms = parms.arrayGet(parms.arrayGetLength() - 1);
+  if (parms.isDict()) {
+    Object predictor = parms.dictLookup("Predictor");
+    if (predictor.isInt() && predictor.getInt() > 1)
+      return false;
+  }
+  return true;
+}
+
 void XmlOutputDev::drawImage(GfxState *state, Object *ref, Stream *str,
                              int width, int height, GfxImageColorMap *colorMap,
                              bool interpolate, const int *maskColors,
                              bool inlineImg) {
   finishText();
+  flushFill();
 
   ImageStream *imgStr;
-  unsigned char *p;
-  GfxRGB rgb;
-  int x, y;
-  int c;
+  int y;
   GfxColorSpaceMode colormode = colorMap->getColorSpace()->getMode();
 
-  writePSFmt("<image width=\"%d\" height=\"%d\"", width, height);
-
 #if POPPLER_VERSION_AT_LEAST(26, 2, 0)
   const auto &matArr = state->getCTM();
   const double *mat = matArr.data();
 #else
   const double *mat = state->getCTM();
 #endif
-  writePSFmt(" rect=\"0 1 1 0\" matrix=\"%g %g %g %g %g %g\"", mat[0], mat[1],
-             mat[2], mat[3], mat[4], mat[5]);
+  if (!startImage(ref, width, height, mat))
+    return;
 
   if (str->getKind() == strDCT && !inlineImg &&
       3 <= colorMap->getNumPixelComps() && colorMap->getNumPixelComps() <= 4) {
     // dump JPEG stream
-    std::vector<char> buffer;
-    // initialize stream
-    str = str->getNextStream();
-#if POPPLER_VERSION_AT_LEAST(26, 1, 0)
-    str->rewind();
-#else
-    str->reset();
-#endif
-    // copy the stream
-    while ((c = str->getChar()) != EOF)
-      buffer.push_back(char(c));
-    str->close();
-
     if (colorMap->getNumPixelComps() == 3)
       writePS(" ColorSpace=\"DeviceRGB\"");
     else
       writePS(" ColorSpace=\"DeviceCMYK\"");
     writePS(" BitsPerComponent=\"8\"");
     writePS(" Filter=\"DCTDecode\"");
-    writePSFmt(" length=\"%d\"", buffer.size());
-    writePS(">\n");
+    writeRawImageData(str->getNextStream());
 
-    for (unsigned int i = 0; i < buffer.size(); ++i)
-      writePSFmt("%02x", buffer[i] & 0xff);
+  } else if (!inlineImg && isRawFlateImage(str, colorMap)) {
+    // dump Flate stream, the samples are already in Ipe's format
+    if (colorMap->getNumPixelComps() == 3)
+      writePS(" ColorSpace=\"DeviceRGB\"");
+    else
+      writePS(" ColorSpace=\"DeviceGray\"");
+    writePS(" BitsPerComponent=\"8\"");
+    writePS(" Filter=\"FlateDecode\"");
+    writeRawImageData(str->getNextStream());
 
 #if 0
   } else if (colorMap->getNumPixelComps() == 1 && colorMap->getBits() == 1) {
@@ -387,7 +1505,7 @@ void XmlOutputDev::drawImage(GfxState *state, Object *ref, Stream *str,
     // copy the stream
     size = height * ((width + 7) / 8);
     for (i = 0; i < size; ++i) {
-      writePSFmt("%02x", (str->getChar() ^ 0xff));
+      iOut->putHex(str->getChar() ^ 0xff);
     }
     str->close();
 #endif
@@ -395,7 +1513,7 @@ void XmlOutputDev::drawImage(GfxState *state, Object *ref, Stream *str,
     // write as gray level image
     writePS(" ColorSpace=\"DeviceGray\"");
     writePS(" BitsPerComponent=\"8\"");
-    writePS(">\n");
+    startImageData();
 
     // initialize stream
     imgStr = new ImageStream(str, width, colorMap->getNumPixelComps(),
@@ -410,21 +1528,16 @@ void XmlOutputDev::drawImage(GfxState *state, Object *ref, Stream *str,
     for (y = 0; y < height; ++y) {
 
       // write the line
-      p = imgStr->getLine();
-      for (x = 0; x < width; ++x) {
-        GfxGray gray;
-        colorMap->getGray(p, &gray);
-        writePSFmt("%02x", colToByte(gray));
-        p += colorMap->getNumPixelComps();
-      }
+      writeGrayLine(colorMap, imgStr->getLine(), width);
     }
     delete imgStr;
+    endImageData();
 
   } else {
     // write as RGB image
     writePS(" ColorSpace=\"DeviceRGB\"");
     writePS(" BitsPerComponent=\"8\"");
-    writePS(">\n");
+    startImageData();
 
     // initialize stream
     imgStr = new ImageStream(str, width, colorMap->getNumPixelComps(),
@@ -439,17 +1552,12 @@ void XmlOutputDev::drawImage(GfxState *state, Object *ref, Stream *str,
     for (y = 0; y < height; ++y) {
 
       // write the line
-      p = imgStr->getLine();
-      for (x = 0; x < width; ++x) {
-        colorMap->getRGB(p, &rgb);
-        writePSFmt("%02x%02x%02x", colToByte(rgb.r), colToByte(rgb.g),
-                   colToByte(rgb.b));
-        p += colorMap->getNumPixelComps();
-      }
+      writeRGBLine(colorMap, imgStr->getLine(), width);
     }
     delete imgStr;
+    endImageData();
   }
-  writePS("\n</image>\n");
+  finishImage();
 }
 
 void XmlOutputDev::drawSoftMaskedImage(GfxState *state, Object *ref,
@@ -460,141 +1568,247 @@ void XmlOutputDev::drawSoftMaskedImage(GfxState *state, Object *ref,
                                        GfxImageColorMap *maskColorMap,
                                        bool maskInterpolate) {
   finishText();
+  flushFill();
 
-  ImageStream *imgStr;
 #if POPPLER_VERSION_AT_LEAST(26, 2, 0)
   const double *mat = state->getCTM().data();
 #else
   const double *mat = state->getCTM();
 #endif
 
+  if (!startImage(ref, width, height, mat))
+    return;
 
-  writePSFmt("<image width=\"%d\" height=\"%d\"", width, height);
-  writePSFmt(" rect=\"0 1 1 0\" matrix=\"%g %g %g %g %g %g\"", mat[0], mat[1],
-             mat[2], mat[3], mat[4], mat[5]);
-
+  // Decode each stream once, classifying it on the way.  The decoded
+  // samples are kept if they fit into the buffer, otherwise the stream
+  // is decoded a second time for writing.
+  ImageStream maskImg(maskStr, maskWidth, maskColorMap->getNumPixelComps(),
+                      maskColorMap->getBits());
+  resetImageStream(maskImg);
+  size_t maskSize = size_t(maskWidth) * maskHeight;
+  bool keepMask = maskSize <= MAX_IMAGE_BUFFER;
+  iMaskBuffer.resize(keepMask ? maskSize : maskWidth);
   bool maskOpaque = true;
-  imgStr = new ImageStream(maskStr, maskWidth, maskColorMap->getNumPixelComps(),
-                           maskColorMap->getBits());
-#if POPPLER_VERSION_AT_LEAST(26, 1, 0)
-    (void)imgStr->rewind();
-#else
-    imgStr->reset();
-#endif
-
   for (int y = 0; y < maskHeight; ++y) {
-    unsigned char *p = imgStr->getLine();
-    for (int x = 0; x < maskWidth; ++x) {
-      GfxGray gray;
-      maskColorMap->getGray(p, &gray);
-      if (colToByte(gray) != 255) {
-        maskOpaque = false;
-        goto escapeMask;
-      }
-      p += maskColorMap->getNumPixelComps();
-    }
+    unsigned char *q =
+        iMaskBuffer.data() + (keepMask ? y * size_t(maskWidth) : 0);
+    convertGrayLine(maskColorMap, maskImg.getLine(), maskWidth, q);
+    for (int x = 0; maskOpaque && x < maskWidth; ++x)
+      maskOpaque = (q[x] == 255);
+    if (!keepMask && !maskOpaque)
+      break;
   }
-escapeMask:
 
+  ImageStream img(str, width, colorMap->getNumPixelComps(),
+                  colorMap->getBits());
+  resetImageStream(img);
+  size_t imgSize = size_t(width) * height * 3;
+  bool keepImage = imgSize <= MAX_IMAGE_BUFFER;
+  iImageBuffer.resize(keepImage ? imgSize : 3 * width);
   bool grayImage = true;
-  imgStr = new ImageStream(str, width, colorMap->getNumPixelComps(),
-                           colorMap->getBits());
-#if POPPLER_VERSION_AT_LEAST(26, 1, 0)
-    (void)imgStr->rewind();
-#else
-    imgStr->reset();
-#endif
-
   for (int y = 0; y < height; ++y) {
-    unsigned char *p = imgStr->getLine();
-    for (int x = 0; x < width; ++x) {
-      GfxRGB rgb;
-      colorMap->getRGB(p, &rgb);
-      if (!(rgb.r == rgb.g && rgb.g == rgb.b)) {
-        grayImage = false;
-        goto escapeGray;
-      }
-      p += colorMap->getNumPixelComps();
-    }
+    unsigned char *q =
+        iImageBuffer.data() + (keepImage ? 3 * y * size_t(width) : 0);
+    convertRGBLine(colorMap, img.getLine(), width, q);
+    for (int x = 0; grayImage && x < width; ++x, q += 3)
+      grayImage = (q[0] == q[1] && q[1] == q[2]);
+    if (!keepImage && !grayImage)
+      break;
   }
-escapeGray:
+  if (!keepImage)
+    resetImageStream(img);
 
   // no mask for gray
   if (grayImage) {
     writePS(" ColorSpace=\"DeviceGray\"");
     writePS(" BitsPerComponent=\"8\"");
-    writePS(">\n");
-
-#if POPPLER_VERSION_AT_LEAST(26, 1, 0)
-    (void)imgStr->rewind();
-#else
-    imgStr->reset();
-#endif
-
+    startImageData();
+    iLine.resize(width);
     for (int y = 0; y < height; ++y) {
-      unsigned char *p = imgStr->getLine();
-      for (int x = 0; x < width; ++x) {
-        GfxGray gray;
-        colorMap->getGray(p, &gray);
-        writePSFmt("%02x", colToByte(gray));
-        p += colorMap->getNumPixelComps();
-      }
+      if (keepImage) {
+        const unsigned char *q = iImageBuffer.data() + 3 * y * size_t(width);
+        for (int x = 0; x < width; ++x)
+          iLine[x] = q[3 * x];
+        writeImageData(iLine.data(), width);
+      } else
+        writeGrayLine(colorMap, img.getLine(), width);
     }
-
-    writePS("\n</image>\n");
+    endImageData();
+    finishImage();
     return;
   }
 
   // RGB
-  writePS(" ColorSpace=\"DeviceRGBAlpha\"");
-  writePS(" BitsPerComponent=\"8\"");
-  writePSFmt(" length=\"%d\"", width * height * 3);
-  writePSFmt(" alphaLength=\"%d\"", maskWidth * maskHeight);
-  writePS(">\n");
+  if (maskOpaque) {
+    // the mask has no effect
+    writePS(" ColorSpace=\"DeviceRGB\"");
+    writePS(" BitsPerComponent=\"8\"");
+    startImageData();
+  } else {
+    writePS(" ColorSpace=\"DeviceRGBAlpha\"");
+    writePS(" BitsPerComponent=\"8\"");
+    writePS(" length=\"");
+    iOut->putInt(imgSize);
+    writePS("\" alphaLength=\"");
+    iOut->putInt(maskSize);
+    writePS("\">\n");
+  }
 
   // RGB data
-  {
-#if POPPLER_VERSION_AT_LEAST(26, 1, 0)
-    (void)imgStr->rewind();
-#else
-    imgStr->reset();
-#endif
-
-    for (int y = 0; y < height; ++y) {
-      unsigned char *p = imgStr->getLine();
-      for (int x = 0; x < width; ++x) {
-        GfxRGB rgb;
-        colorMap->getRGB(p, &rgb);
-        writePSFmt("%02x%02x%02x", colToByte(rgb.r), colToByte(rgb.g),
-                   colToByte(rgb.b));
-        p += colorMap->getNumPixelComps();
-      }
-    }
+  if (keepImage)
+    writeImageData(iImageBuffer.data(), imgSize);
+  else {
+    for (int y = 0; y < height; ++y)
+      writeRGBLine(colorMap, img.getLine(), width);
   }
 
   // Alpha mask
-  {
-    imgStr =
-        new ImageStream(maskStr, maskWidth, maskColorMap->getNumPixelComps(),
-                        maskColorMap->getBits());
+  if (maskOpaque)
+    endImageData();
+  else if (keepMask)
+    writeImageData(iMaskBuffer.data(), maskSize);
+  else {
+    resetImageStream(maskImg);
+    for (int y = 0; y < maskHeight; ++y)
+      writeGrayLine(maskColorMap, maskImg.getLine(), maskWidth);
+  }
+
+  finishImage();
+
+  // don't hold on to the memory of a large image
+  if (iImageBuffer.capacity() > MAX_IMAGE_BUFFER / 4)
+    std::vector<unsigned char>().swap(iImageBuffer);
+  if (iMaskBuffer.capacity() > MAX_IMAGE_BUFFER / 4)
+    std::vector<unsigned char>().swap(iMaskBuffer);
+}
+
+// Convert one line of image samples to 8-bit gray.
+void XmlOutputDev::convertGrayLine(GfxImageColorMap *colorMap,
+                                   unsigned char *p, int width,
+                                   unsigned char *q) {
+  for (int x = 0; x < width; ++x) {
+    GfxGray gray;
+    colorMap->getGray(p, &gray);
+    q[x] = colToByte(gray);
+    p += colorMap->getNumPixelComps();
+  }
+}
+
+// Convert one line of image samples to 8-bit RGB.
+void XmlOutputDev::convertRGBLine(GfxImageColorMap *colorMap,
+                                  unsigned char *p, int width,
+                                  unsigned char *q) {
+  for (int x = 0; x < width; ++x) {
+    GfxRGB rgb;
+    colorMap->getRGB(p, &rgb);
+    *q++ = colToByte(rgb.r);
+    *q++ = colToByte(rgb.g);
+    *q++ = colToByte(rgb.b);
+    p += colorMap->getNumPixelComps();
+  }
+}
+
+// Convert one line of image samples to 8-bit gray and write it.
+void XmlOutputDev::writeGrayLine(GfxImageColorMap *colorMap,
+                                 unsigned char *p, int width) {
+  iLine.resize(width);
+  convertGrayLine(colorMap, p, width, iLine.data());
+  writeImageData(iLine.data(), width);
+}
+
+// Convert one line of image samples to 8-bit RGB and write it.
+void XmlOutputDev::writeRGBLine(GfxImageColorMap *colorMap, unsigned char *p,
+                                int width) {
+  iLine.resize(3 * width);
+  convertRGBLine(colorMap, p, width, iLine.data());
+  writeImageData(iLine.data(), 3 * width);
+}
+
+// Called after the attributes of a decoded image have been written.
+// With flate compression, the image data is collected by a Deflater
+// until endImageData, since its length must be known first.
+void XmlOutputDev::startImageData() {
+  if (iFlateLevel > 0) {
+    iDeflater = new Deflater(iFlateLevel);
+    if (iDeflater->isOk())
+      return;
+    delete iDeflater;
+    iDeflater = nullptr;
+  }
+  writePS(">\n");
+}
+
+void XmlOutputDev::endImageData() {
+  if (!iDeflater)
+    return;
+  Deflater *deflater = iDeflater;
+  iDeflater = nullptr;
+  deflater->finish();
+  writePS(" Filter=\"FlateDecode\" length=\"");
+  iOut->putInt(deflater->size());
+  writePS("\">\n");
+  deflater->copyTo([this](const unsigned char *data, size_t len) {
+    writeImageData(data, len);
+  });
+  delete deflater;
+}
+
+// Write the length attribute and the data of an image whose data is
+// copied without decoding from str.  If str is the stream stored in
+// the PDF file or in memory, its length is known and the data is
+// copied in blocks.  Otherwise it has to be read completely to find
+// the length.
+void XmlOutputDev::writeRawImageData(Stream *str) {
+  long long length = -1;
+  BaseStream *base = str->getBaseStream();
+  if (base == str)
+    length = base->getLength();
 #if POPPLER_VERSION_AT_LEAST(26, 1, 0)
-    (void)imgStr->rewind();
+  str->rewind();
 #else
-    imgStr->reset();
+  str->reset();
 #endif
-
-    for (int y = 0; y < maskHeight; ++y) {
-      unsigned char *p = imgStr->getLine();
-      for (int x = 0; x < maskWidth; ++x) {
-        GfxGray gray;
-        maskColorMap->getGray(p, &gray);
-        writePSFmt("%02x", colToByte(gray));
-        p += maskColorMap->getNumPixelComps();
-      }
+  unsigned char buf[RAW_CHUNK_SIZE];
+  if (length >= 0) {
+    writePS(" length=\"");
+    iOut->putInt(length);
+    writePS("\">\n");
+    while (length > 0) {
+      int n = str->doGetChars(length < RAW_CHUNK_SIZE ? int(length)
+                                                      : RAW_CHUNK_SIZE,
+                              buf);
+      if (n <= 0)
+        break;
+      writeImageData(buf, n);
+      length -= n;
     }
+    // if the stream is shorter than it claims, keep the XML consistent
+    memset(buf, 0, sizeof(buf));
+    while (length > 0) {
+      int n = length < RAW_CHUNK_SIZE ? int(length) : RAW_CHUNK_SIZE;
+      writeImageData(buf, n);
+      length -= n;
+    }
+  } else {
+    std::vector<unsigned char> buffer;
+    int n;
+    while ((n = str->doGetChars(RAW_CHUNK_SIZE, buf)) > 0)
+      buffer.insert(buffer.end(), buf, buf + n);
+    writePS(" length=\"");
+    iOut->putInt(buffer.size());
+    writePS("\">\n");
+    writeImageData(buffer.data(), buffer.size());
   }
+  str->close();
+}
 
-  writePS("\n</image>\n");
+void XmlOutputDev::writeImageData(const unsigned char *data, size_t len) {
+  if (iDeflater)
+    iDeflater->put(data, len);
+  else if (iBase64)
+    iOut->putBase64(data, len);
+  else
+    iOut->putHexBytes(data, len);
 }
 
 // --------------------------------------------------------------------
@@ -745,47 +1959,185 @@ void XmlOutputDev::writePSChar(int code) {
   else if (code == '&')
     writePS("&amp;");
   else if (code < 0x80)
-    writePSFmt("%c", code);
+    iOut->put(char(code));
   else {
     iUnicode = true;
     if (iUnicodeLevel < 2) {
-      writePSFmt("[U+%x]", code);
+      writePS("[U+");
+      iOut->putHex(code, 1);
+      iOut->put(']');
       fprintf(stderr, "Unknown Unicode character U+%x on page %d\n", code,
               seqPage);
     } else {
       if (code < 0x800) {
-        writePSFmt("%c%c", (((code & 0x7c0) >> 6) | 0xc0),
-                   ((code & 0x03f) | 0x80));
+        iOut->put(char(((code & 0x7c0) >> 6) | 0xc0));
+        iOut->put(char((code & 0x03f) | 0x80));
       } else {
         // Do we never need to write UCS larger than 0x10000?
-        writePSFmt("%c%c%c", (((code & 0x0f000) >> 12) | 0xe0),
-                   (((code & 0xfc0) >> 6) | 0x80), ((code & 0x03f) | 0x80));
+        iOut->put(char(((code & 0x0f000) >> 12) | 0xe0));
+        iOut->put(char(((code & 0xfc0) >> 6) | 0x80));
+        iOut->put(char((code & 0x03f) | 0x80));
       }
     }
   }
 }
 
+// Write a color attribute value, with the name of a palette color if
+// there is a palette.
 void XmlOutputDev::writeColor(const char *prefix, const GfxRGB &rgb,
                               const char *suffix) {
   if (prefix)
     writePS(prefix);
-  writePSFmt("\"%f %f %f\"", colToDbl(rgb.r), colToDbl(rgb.g), colToDbl(rgb.b));
+  iOut->put('"');
+  if (iPalette) {
+    iOut->put('c');
+    iOut->putInt(paletteColor(rgb));
+  } else
+    writeRGB(rgb);
+  iOut->put('"');
   if (suffix)
     writePS(suffix);
 }
 
-void XmlOutputDev::writePS(const char *s) {
-  fwrite(s, 1, strlen(s), outputStream);
+void XmlOutputDev::writeRGB(const GfxRGB &rgb) {
+  iOut->putDecimal(colToDbl(rgb.r), 4);
+  iOut->put(' ');
+  iOut->putDecimal(colToDbl(rgb.g), 4);
+  iOut->put(' ');
+  iOut->putDecimal(colToDbl(rgb.b), 4);
+}
+
+// Return the id of the palette color for rgb, adding it to the style
+// sheet if it is new.  Colors are told apart at the precision they
+// are written with.
+int XmlOutputDev::paletteColor(const GfxRGB &rgb) {
+  unsigned long long key = 0;
+  for (GfxColorComp c : {rgb.r, rgb.g, rgb.b})
+    key = key * 10001 + (unsigned long long)(colToDbl(c) * 10000 + 0.5);
+  auto it = iPaletteIds.find(key);
+  if (it != iPaletteIds.end())
+    return it->second;
+  int id = iPaletteIds.size() + 1;
+  iPaletteIds.emplace(key, id);
+  std::string value;
+  XmlWriter *out = iOut;
+  XmlWriter w(value);
+  iOut = &w;
+  writeRGB(rgb);
+  w.flush();
+  iOut = out;
+  iStyle += "<color name=\"c" + std::to_string(id) + "\" value=\"" + value +
+            "\"/>\n";
+  return id;
 }
 
-void XmlOutputDev::writePSFmt(const char *fmt, ...) {
-  va_list args;
-  char buf[512];
+void XmlOutputDev::writePS(const char *s) { iOut->put(s); }
+
+void XmlOutputDev::writeCoords(double x, double y) {
+  iOut->putDouble(x);
+  iOut->put(' ');
+  iOut->putDouble(y);
+}
+
+// Write the start tag of an image, up to its color space attributes.
+// With shared bitmaps, the image data goes into a <bitmap> element
+// before the pages, and the page gets an <image> referring to it.
+// Returns false if the bitmap was written before, in which case only
+// the reference has been written.
+bool XmlOutputDev::startImage(Object *ref, int width, int height,
+                              const double *mat) {
+  if (iShareBitmaps) {
+    for (int i = 0; i < 6; ++i)
+      iImageMatrix[i] = mat[i];
+    iBitmapHasRef = ref && ref->isRef();
+    if (iBitmapHasRef) {
+      Ref r = ref->getRef();
+      iBitmapKey = std::make_pair(r.num, r.gen);
+      auto it = iBitmapRefs.find(iBitmapKey);
+      if (it != iBitmapRefs.end()) {
+        writeImageReference(it->second);
+        return false;
+      }
+    }
+    iInBitmap = true;
+    iPageOut = iOut;
+    if (iBitmapHasRef) {
+      // XObject images are written to the document right away
+      iOut = iDoc;
+      writePS("<bitmap id=\"");
+      iOut->putInt(++iNumBitmaps);
+      iOut->put('"');
+    } else {
+      // inline images are recognized by their content
+      iBitmapData.clear();
+      iOut = new XmlWriter(iBitmapData);
+    }
+  } else {
+    writePS("<image");
+  }
+  writePS(" width=\"");
+  iOut->putInt(width);
+  writePS("\" height=\"");
+  iOut->putInt(height);
+  iOut->put('"');
+  if (!iInBitmap) {
+    writePS(" rect=\"0 1 1 0\" matrix=\"");
+    writeMatrix(mat);
+    iOut->put('"');
+  }
+  if (iBase64)
+    writePS(" encoding=\"base64\"");
+  return true;
+}
+
+void XmlOutputDev::finishImage() {
+  if (iBase64)
+    iOut->finishBase64();
+  if (!iInBitmap) {
+    writePS("\n</image>\n");
+    return;
+  }
+  writePS("\n</bitmap>\n");
+  iInBitmap = false;
+  int id;
+  if (iBitmapHasRef) {
+    id = iNumBitmaps;
+    iBitmapRefs[iBitmapKey] = id;
+  } else {
+    delete iOut; // appends the rest to iBitmapData
+    // the digest stands in for the content, which may be large
+    std::string key = sha256(iBitmapData.data(), iBitmapData.size()) +
+                      std::to_string(iBitmapData.size());
+    auto it = iInlineBitmaps.find(key);
+    if (it != iInlineBitmaps.end()) {
+      id = it->second;
+    } else {
+      id = ++iNumBitmaps;
+      iDoc->put("<bitmap id=\"");
+      iDoc->putInt(id);
+      iDoc->put('"');
+      iDoc->put(iBitmapData.data(), iBitmapData.size());
+      iInlineBitmaps.emplace(std::move(key), id);
+    }
+  }
+  iOut = iPageOut;
+  writeImageReference(id);
+}
+
+void XmlOutputDev::writeImageReference(int id) {
+  writePS("<image bitmap=\"");
+  iOut->putInt(id);
+  writePS("\" rect=\"0 1 1 0\" matrix=\"");
+  writeMatrix(iImageMatrix);
+  writePS("\"/>\n");
+}
 
-  va_start(args, fmt);
-  vsprintf(buf, fmt, args);
-  va_end(args);
-  fwrite(buf, 1, strlen(buf), outputStream);
+void XmlOutputDev::writeMatrix(const double *mat) {
+  writeCoords(mat[0], mat[1]);
+  iOut->put(' ');
+  writeCoords(mat[2], mat[3]);
+  iOut->put(' ');
+  writeCoords(mat[4], mat[5]);
 }
 
 // --------------------------------------------------------------------
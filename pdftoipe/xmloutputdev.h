@@ -10,10 +10,20 @@
 #include "Object.h"
 #include "OutputDev.h"
 #include "cpp/poppler-version.h"
+#include "simplify.h"
+#include "textlayout.h"
+#include "xmlwriter.h"
 #include <stddef.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 class GfxPath;
 class GfxFont;
+class Deflater;
+class PDFDoc;
 
 #define PDFTOIPE_VERSION "2024/11/15"
 
@@ -25,13 +35,24 @@ class GfxFont;
 
 class XmlOutputDev : public OutputDev {
 public:
-  // Open an XML output file, and write the prolog.
+  // Open an XML output file ("-" for stdout), and write the prolog.
   XmlOutputDev(const std::string &fileName, XRef *xrefA, Catalog *catalog,
                int firstPage, int lastPage);
 
+  // Pass the complete document to a sink.
+  XmlOutputDev(const XmlWriter::Sink &sink, XRef *xrefA, Catalog *catalog,
+               int firstPage, int lastPage);
+
+  // Write only the pages, without prolog and trailer, to a string.
+  // Pages are numbered sequentially starting at seqPageA.
+  XmlOutputDev(std::string &pages, XRef *xrefA, int seqPageA);
+
   // Destructor -- writes the trailer and closes the file.
   virtual ~XmlOutputDev();
 
+  // Append pages converted by another XmlOutputDev.
+  void appendPages(const std::string &pages, bool unicode);
+
   // Check if file was successfully created.
   bool isOk() { return ok; }
 
@@ -40,6 +61,37 @@ public:
   void setTextHandling(bool math, bool notext, bool literal, int mergeLevel,
                        bool noTextSize, int unicodeLevel);
 
+  // Write image data in base64 instead of hex, and compress decoded
+  // images with the given zlib level (0 for no compression).  With
+  // shareBitmaps, each distinct image is written only once.
+  void setImageHandling(bool base64, int flateLevel, bool shareBitmaps);
+
+  // Convert axial and radial shadings to Ipe gradients, and draw tiling
+  // patterns with Ipe symbols.  Gradients and symbols go into a style
+  // sheet before the first page, so the pages are held back until the
+  // end of the document.
+  void setShadingHandling(bool gradients, bool patterns);
+
+  // Draw each form XObject once, as an Ipe symbol, using doc to
+  // interpret it (nullptr to draw forms in place).
+  void setFormHandling(PDFDoc *doc);
+
+  // Draw a path as a reference to a symbol from the symbolThreshold-th
+  // time on that the same shape is drawn at some position (0 for never).
+  // Remove vertices of straight segments that are within
+  // simplifyTolerance of their neighbours' segment (0 for none).
+  void setPathHandling(int symbolThreshold, double simplifyTolerance);
+
+  // Define each color in the style sheet, and refer to it by name.
+  void setColorHandling(bool palette);
+
+  // Round pen widths and dash patterns to multiples of tolerance, define
+  // them in the style sheet, and refer to them by name (0 for never).
+  void setPenHandling(double tolerance);
+
+  // Round coordinates to this many decimals (-1 for 6 significant digits).
+  void setPrecision(int decimals);
+
   //---- get info about output device
 
   // Does this device use upside-down coordinates?
@@ -53,6 +105,15 @@ public:
   // text in Type 3 fonts will be drawn with drawChar/drawString.
   virtual bool interpretType3Chars() override { return false; }
 
+  // Does this device use axialShadedFill/radialShadedFill?
+  virtual bool useShadedFills(int type) override;
+
+  // Does this device use tilingPatternFill()?
+  virtual bool useTilingPatternFill() override;
+
+  // Does this device use drawForm()?
+  virtual bool useDrawForm() override;
+
   //----- initialization and control
 
   // Start a page.
@@ -61,7 +122,47 @@ public:
   // End a page.
   virtual void endPage() override;
 
+  //----- save/restore graphics state
+  virtual void saveState(GfxState *state) override;
+  virtual void restoreState(GfxState *state) override;
+
   //----- update graphics state
+  // (the state is remembered for drawForm, which is not given one;
+  // after saveState, poppler changes a copy of the state it passed, so
+  // every change must update it)
+  virtual void updateAll(GfxState *state) override {
+    iState = state;
+    OutputDev::updateAll(state);
+  }
+  virtual void updateCTM(GfxState *state, double, double, double, double,
+                         double, double) override {
+    iState = state;
+  }
+  virtual void updateLineDash(GfxState *state) override { iState = state; }
+  virtual void updateLineJoin(GfxState *state) override { iState = state; }
+  virtual void updateLineCap(GfxState *state) override { iState = state; }
+  virtual void updateMiterLimit(GfxState *state) override { iState = state; }
+  virtual void updateLineWidth(GfxState *state) override { iState = state; }
+  virtual void updateFillColorSpace(GfxState *state) override {
+    iState = state;
+  }
+  virtual void updateStrokeColorSpace(GfxState *state) override {
+    iState = state;
+  }
+  virtual void updateFillColor(GfxState *state) override { iState = state; }
+  virtual void updateStrokeColor(GfxState *state) override { iState = state; }
+  virtual void updateFillOpacity(GfxState *state) override { iState = state; }
+  virtual void updateStrokeOpacity(GfxState *state) override {
+    iState = state;
+  }
+  virtual void updateFont(GfxState *state) override { iState = state; }
+  virtual void updateRender(GfxState *state) override { iState = state; }
+  virtual void updateCharSpace(GfxState *state) override { iState = state; }
+  virtual void updateWordSpace(GfxState *state) override { iState = state; }
+  virtual void updateHorizScaling(GfxState *state) override {
+    iState = state;
+  }
+  virtual void updateRise(GfxState *state) override { iState = state; }
   virtual void updateTextPos(GfxState *state) override;
   virtual void updateTextShift(GfxState *state, double shift) override;
 
@@ -69,8 +170,25 @@ public:
   virtual void stroke(GfxState *state) override;
   virtual void fill(GfxState *state) override;
   virtual void eoFill(GfxState *state) override;
+  virtual bool axialShadedFill(GfxState *state, GfxAxialShading *shading,
+                               double tMin, double tMax) override;
+  virtual bool radialShadedFill(GfxState *state, GfxRadialShading *shading,
+                                double sMin, double sMax) override;
+  virtual bool tilingPatternFill(GfxState *state, Gfx *gfx, Catalog *cat,
+                                 GfxTilingPattern *tPat, const double *mat,
+                                 int x0, int y0, int x1, int y1, double xStep,
+                                 double yStep) override;
+
+  //----- path clipping
+  virtual void clip(GfxState *state) override;
+  virtual void eoClip(GfxState *state) override;
+  virtual void clipToStrokePath(GfxState *state) override;
+
+  //----- form XObjects
+  virtual void drawForm(Ref id) override;
 
   //----- text drawing
+  virtual void endTextObject(GfxState *state) override;
   virtual void drawChar(GfxState *state, double x, double y, double dx,
                         double dy, double originX, double originY,
                         CharCode code, int nBytes, const Unicode *u,
@@ -90,22 +208,78 @@ public:
                                    bool maskInterpolate) override;
 
 protected:
+  void initialize(XRef *xrefA);
+  void writeProlog(Catalog *catalog, int pageNum);
   void startDrawingPath();
   void startText(GfxState *state, double x, double y);
+  void textMatrix(GfxState *state, double *M);
+  void writeTextStyle(GfxState *state, const double *M);
+  void writeChar(CharCode code, const Unicode *u, int uLen);
+  void layoutChar(GfxState *state, double x, double y, double dx, double dy,
+                  CharCode code, const Unicode *u, int uLen);
+  void writeTextLayout();
   void finishText();
   void writePSUnicode(int ch);
 
-  void doPath(GfxState *state);
+  void doPath(GfxState *state, double dx = 0, double dy = 0);
+  void formatPath(GfxState *state, double dx = 0, double dy = 0);
+  void formatShape(GfxState *state);
+  void startPath();
+  int shapeSymbol(std::string &&key);
+  void finishPath(const std::string &path, const std::string &shape,
+                  double x, double y);
+  void holdFill(GfxState *state, bool evenOdd);
+  void flushFill();
+  bool shadedFill(GfxState *state, GfxUnivariateShading *shading,
+                  const char *type, const double *coords, int numCoords);
+  void writeClipPath(GfxState *state);
+  int openClipGroups();
+  void closeClipGroups(int n);
+  std::string inheritedFont(GfxState *state, Dict *resDict);
+  int formSymbol(Stream *str, Dict *resDict, const PDFRectangle &box,
+                 const std::string &prefix);
+  XmlWriter *startCapture(std::string &s);
+  void endCapture(XmlWriter *out);
+  int repeatSymbol(int id, int count, double dx, double dy);
+  void useSymbol(std::string &s, int id, double x, double y);
+  int defineSymbol(const std::string &object);
   void writePSChar(int code);
   void writePS(const char *s);
-  void writePSFmt(const char *fmt, ...);
+  void writeCoords(double x, double y);
+  void writeMatrix(const double *mat);
+  bool startImage(Object *ref, int width, int height, const double *mat);
+  void writeImageReference(int id);
+  void convertGrayLine(GfxImageColorMap *colorMap, unsigned char *p,
+                       int width, unsigned char *q);
+  void convertRGBLine(GfxImageColorMap *colorMap, unsigned char *p,
+                      int width, unsigned char *q);
+  void writeGrayLine(GfxImageColorMap *colorMap, unsigned char *p, int width);
+  void writeRGBLine(GfxImageColorMap *colorMap, unsigned char *p, int width);
+  void startImageData();
+  void endImageData();
+  void writeRawImageData(Stream *str);
+  void writeImageData(const unsigned char *data, size_t len);
+  void finishImage();
+  bool deferPages() const;
+  void startSpool();
+  void finishSpool();
+  void flushPage();
   void writeColor(const char *prefix, const GfxRGB &rgb, const char *suffix);
+  void writeRGB(const GfxRGB &rgb);
+  int paletteColor(const GfxRGB &rgb);
+  double quantize(double v) const;
+  void writePen(double width);
+  void writeDash(const std::vector<double> &pattern, double offset);
+  void writeDashValue(const std::vector<double> &pattern, double offset);
 
 protected:
   FILE *outputStream;
+  XmlWriter *iDoc; // buffered sink for outputStream
+  XmlWriter *iOut; // where output currently goes
   int seqPage;   // current sequential page number
   XRef *xref;    // the xref table for this PDF file
   bool ok;       // set up ok?
+  bool iFragment; // writing pages only?
   bool iUnicode; // has a Unicode character been used?
 
   bool iIsLiteral;   // take latex in text literally
@@ -114,7 +288,102 @@ protected:
   bool inText;       // inside a text object
   bool iNoTextSize;  // all text objects at normal size
   int iMergeLevel;   // text merge level
+  int iCaptureDepth; // inside a symbol being drawn
+
+  // glyphs of the page, assembled into lines at the end (merge level 3)
+  TextLayout iLayout;
+  std::vector<std::string> iTextStyles; // text start tags
+  std::unordered_map<std::string, int> iTextStyleIds;
+  XmlWriter *iGlyphOut; // formats glyphs and start tags into iGlyphText
+  std::string iGlyphText;
   int iUnicodeLevel; // unicode handling
+  bool iBase64;      // write image data in base64
+  int iFlateLevel;   // zlib level for decoded images, 0 for none
+
+  Deflater *iDeflater; // compressor for the current image, if any
+
+  bool iShareBitmaps; // write each distinct image once as a <bitmap>
+  FILE *iSpoolFile;   // pages are spooled here while sharing bitmaps
+  XmlWriter *iSpool;
+  int iNumBitmaps;
+  std::map<std::pair<int, int>, int> iBitmapRefs; // XObject ref -> id
+  // SHA-256 digest and length of the content -> id
+  std::unordered_map<std::string, int> iInlineBitmaps;
+
+  // the bitmap currently being written
+  bool iInBitmap;
+  bool iBitmapHasRef;
+  std::pair<int, int> iBitmapKey;
+  std::string iBitmapData; // bitmap of an inline image
+  XmlWriter *iPageOut;     // output to return to afterwards
+  double iImageMatrix[6];
+
+  // a fill waiting to be merged with a stroke of the same path
+  bool iHasFill;
+  bool iFillEvenOdd;
+  GfxRGB iFillColor;
+  std::string iFillPath;
+  std::string iFillShape;
+  double iFillX, iFillY;
+  XmlWriter *iPathOut; // formats paths into iPathText
+  std::string iPathText;
+
+  double iSimplifyTolerance;      // for straight segments, 0 for none
+  std::vector<PathPoint> iPolyline; // straight segments being simplified
+
+  // paths drawn often enough become references to symbols
+  int iSymbolThreshold;
+  // start tag and shape -> symbol, or how often drawn so far
+  std::unordered_map<std::string, int> iShapeSymbols;
+  std::unordered_map<std::string, int> iShapeCounts;
+  std::string iShapeText; // path relative to its first point
+  double iShapeX, iShapeY;
+  XmlWriter *iStartOut; // formats the start tag into iPathStart
+  std::string iPathStart;
+  XmlWriter *iPathReturn; // output to return to afterwards
+
+  bool iGradients; // convert shadings to gradients
+  std::string iStyle; // generated style sheet entries
+  int iNumGradients;
+  std::unordered_map<std::string, int> iGradientNames; // definition -> id
+
+  bool iPatterns; // draw tiling patterns with symbols
+  int iNumSymbols;
+  std::unordered_map<std::string, int> iSymbolNames; // object -> id
+
+  PDFDoc *iFormDoc;  // draw forms as symbols, interpreted with this document
+  GfxState *iState;  // the current graphics state
+  std::unordered_map<std::string, int> iFormSymbols; // form and state -> id
+  std::vector<Ref> iFormsDrawing; // forms whose symbols are being drawn
+  std::vector<Dict *> iResources; // of the page and the forms being drawn
+
+  bool iPalette; // colors are named in the style sheet
+  std::unordered_map<unsigned long long, int> iPaletteIds; // color -> id
+
+  double iPenTolerance; // pens and dashes are named in the style sheet
+  std::unordered_map<long long, int> iPenIds;    // width / tolerance -> id
+  std::unordered_map<std::string, int> iDashIds; // pattern -> id
+  XmlWriter *iPenOut; // formats pen and dash values into iPenText
+  std::string iPenText;
+
+  // the clipping paths in effect, outermost first, with the clipping
+  // bounding box standing in when there are none; not exact after
+  // clipping to a stroke or to text, whose outline cannot be written
+  struct ClipPath {
+    std::string path;
+    bool evenOdd = false;
+  };
+  struct Clip {
+    std::vector<ClipPath> paths;
+    bool exact = true;
+  };
+  Clip iClip;
+  std::vector<Clip> iClipStack;
+  bool iTextClip; // glyphs of this text object are added to the clip
+
+  std::vector<unsigned char> iLine; // one converted line of image data
+  std::vector<unsigned char> iImageBuffer; // decoded soft-masked image
+  std::vector<unsigned char> iMaskBuffer;  // and its mask
 };
 
 // --------------------------------------------------------------------
@@ -0,0 +1,258 @@
+// --------------------------------------------------------------------
+// Buffered sink for the XML stream
+// --------------------------------------------------------------------
+
+#include "xmlwriter.h"
+
+#include <charconv>
+#include <cmath>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+static const char hexDigits[] = "0123456789abcdef";
+static const char base64Digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Write 4 * groups base64 digits for 3 * groups bytes of data to out.
+static void encodeBase64(const unsigned char *data, size_t groups, char *out) {
+  for (size_t i = 0; i < groups; ++i) {
+    unsigned int v = (data[0] << 16) | (data[1] << 8) | data[2];
+    out[0] = base64Digits[v >> 18];
+    out[1] = base64Digits[(v >> 12) & 0x3f];
+    out[2] = base64Digits[(v >> 6) & 0x3f];
+    out[3] = base64Digits[v & 0x3f];
+    data += 3;
+    out += 4;
+  }
+}
+
+// --------------------------------------------------------------------
+
+#if defined(__SSE2__)
+// Turn 16 nibbles into their lower-case hex digits.
+static inline __m128i hexNibbles(__m128i v) {
+  const __m128i nine = _mm_set1_epi8(9);
+  __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(v, nine), _mm_set1_epi8(39));
+  return _mm_add_epi8(_mm_add_epi8(v, _mm_set1_epi8('0')), letters);
+}
+#endif
+
+#if defined(__AVX2__)
+static inline __m256i hexNibbles(__m256i v) {
+  const __m256i nine = _mm256_set1_epi8(9);
+  __m256i letters =
+      _mm256_and_si256(_mm256_cmpgt_epi8(v, nine), _mm256_set1_epi8(39));
+  return _mm256_add_epi8(_mm256_add_epi8(v, _mm256_set1_epi8('0')), letters);
+}
+#endif
+
+// Write 2 * len hex digits for the bytes in data to out.
+static void encodeHex(const unsigned char *data, size_t len, char *out) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  const __m256i mask4 = _mm256_set1_epi8(0x0f);
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+    __m256i hi = hexNibbles(_mm256_and_si256(_mm256_srli_epi16(v, 4), mask4));
+    __m256i lo = hexNibbles(_mm256_and_si256(v, mask4));
+    // unpack works within 128-bit lanes, so reorder the lanes afterwards
+    __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *)(out + 2 * i),
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(out + 2 * i + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+    __m128i hi = hexNibbles(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = hexNibbles(_mm_and_si128(v, mask));
+    _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+#endif
+  for (; i < len; ++i) {
+    out[2 * i] = hexDigits[data[i] >> 4];
+    out[2 * i + 1] = hexDigits[data[i] & 0x0f];
+  }
+}
+
+//------------------------------------------------------------------------
+// XmlWriter
+//------------------------------------------------------------------------
+
+XmlWriter::XmlWriter(FILE *f)
+    : iFile(f), iTarget(nullptr), iFill(0), iPrecision(-1), iBase64Count(0) {
+  iBuffer = new char[kBufferSize];
+}
+
+XmlWriter::XmlWriter(std::string &target)
+    : iFile(nullptr), iTarget(&target), iFill(0), iPrecision(-1),
+      iBase64Count(0) {
+  iBuffer = new char[kBufferSize];
+}
+
+XmlWriter::XmlWriter(const Sink &sink)
+    : iFile(nullptr), iTarget(nullptr), iSink(sink), iFill(0), iPrecision(-1),
+      iBase64Count(0) {
+  iBuffer = new char[kBufferSize];
+}
+
+void XmlWriter::write(const char *s, size_t len) {
+  if (iFile)
+    fwrite(s, 1, len, iFile);
+  else if (iTarget)
+    iTarget->append(s, len);
+  else
+    iSink(s, len);
+}
+
+XmlWriter::~XmlWriter() {
+  flush();
+  delete[] iBuffer;
+}
+
+void XmlWriter::flushBuffer() {
+  if (iFill > 0)
+    write(iBuffer, iFill);
+  iFill = 0;
+}
+
+void XmlWriter::flush() {
+  flushBuffer();
+  if (iFile)
+    fflush(iFile);
+}
+
+void XmlWriter::putLong(const char *s, size_t len) {
+  flushBuffer();
+  if (len < kBufferSize) {
+    memcpy(iBuffer, s, len);
+    iFill = len;
+  } else
+    write(s, len);
+}
+
+// ----------------------------------------------------------
+
+void XmlWriter::putInt(long long value) {
+  char *p = reserve(24);
+  iFill += std::to_chars(p, p + 24, value).ptr - p;
+}
+
+void XmlWriter::putDouble(double value) {
+  if (iPrecision < 0) {
+    char *p = reserve(32);
+    iFill +=
+        std::to_chars(p, p + 32, value, std::chars_format::general, 6).ptr - p;
+  } else
+    putDecimal(value, iPrecision);
+}
+
+void XmlWriter::putDecimal(double value, int decimals) {
+  if (!(fabs(value) < 1e15)) {
+    // huge or not finite, fixed notation makes no sense
+    char *p = reserve(32);
+    iFill +=
+        std::to_chars(p, p + 32, value, std::chars_format::general, 6).ptr - p;
+    return;
+  }
+  decimals = std::clamp(decimals, 0, kMaxDecimals);
+  char *p = reserve(32 + decimals);
+  char *q = std::to_chars(p, p + 32 + decimals, value,
+                          std::chars_format::fixed, decimals)
+                .ptr;
+  if (decimals > 0) {
+    // drop trailing zeros and a trailing decimal point
+    while (q[-1] == '0')
+      --q;
+    if (q[-1] == '.')
+      --q;
+  }
+  if (q - p == 2 && p[0] == '-' && p[1] == '0') {
+    // rounded to negative zero
+    p[0] = '0';
+    --q;
+  }
+  iFill += q - p;
+}
+
+void XmlWriter::putHex(unsigned int value, int minDigits) {
+  char *p = reserve(16);
+  char *q = std::to_chars(p, p + 16, value, 16).ptr;
+  int digits = q - p;
+  if (digits < minDigits) {
+    memmove(p + minDigits - digits, p, digits);
+    memset(p, '0', minDigits - digits);
+    q = p + minDigits;
+  }
+  iFill += q - p;
+}
+
+void XmlWriter::putHexBytes(const unsigned char *data, size_t len) {
+  while (len > 0) {
+    size_t n = (kBufferSize - iFill) / 2;
+    if (n == 0) {
+      flushBuffer();
+      continue;
+    }
+    if (n > len)
+      n = len;
+    encodeHex(data, n, iBuffer + iFill);
+    iFill += 2 * n;
+    data += n;
+    len -= n;
+  }
+}
+
+void XmlWriter::putBase64(const unsigned char *data, size_t len) {
+  if (iBase64Count > 0) {
+    while (iBase64Count < 3 && len > 0) {
+      iBase64Carry[iBase64Count++] = *data++;
+      --len;
+    }
+    if (iBase64Count < 3)
+      return;
+    encodeBase64(iBase64Carry, 1, reserve(4));
+    iFill += 4;
+    iBase64Count = 0;
+  }
+  while (len >= 3) {
+    size_t groups = (kBufferSize - iFill) / 4;
+    if (groups == 0) {
+      flushBuffer();
+      continue;
+    }
+    if (groups > len / 3)
+      groups = len / 3;
+    encodeBase64(data, groups, iBuffer + iFill);
+    iFill += 4 * groups;
+    data += 3 * groups;
+    len -= 3 * groups;
+  }
+  while (len > 0) {
+    iBase64Carry[iBase64Count++] = *data++;
+    --len;
+  }
+}
+
+void XmlWriter::finishBase64() {
+  if (iBase64Count == 0)
+    return;
+  unsigned char group[3] = {0, 0, 0};
+  memcpy(group, iBase64Carry, iBase64Count);
+  char *p = reserve(4);
+  encodeBase64(group, 1, p);
+  p[3] = '=';
+  if (iBase64Count == 1)
+    p[2] = '=';
+  iFill += 4;
+  iBase64Count = 0;
+}
+
+// --------------------------------------------------------------------
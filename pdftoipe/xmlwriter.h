@@ -0,0 +1,106 @@
+// -*- C++ -*-
+// --------------------------------------------------------------------
+// XmlWriter.h
+// --------------------------------------------------------------------
+
+#ifndef XMLWRITER_H
+#define XMLWRITER_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+
+// Buffered output sink for the XML stream.
+//
+// All output of XmlOutputDev goes through an XmlWriter, which collects
+// it in a large buffer and hands it to the file (or appends it to a
+// string, or passes it to a sink) in big blocks.  The typed put
+// methods format numbers directly into the buffer, so no format string
+// is ever parsed.
+class XmlWriter {
+public:
+  // Receives the output in blocks.
+  typedef std::function<void(const char *data, size_t len)> Sink;
+
+  // More decimals than a double has digits are never needed.
+  static constexpr int kMaxDecimals = 17;
+
+  explicit XmlWriter(FILE *f);
+  explicit XmlWriter(std::string &target);
+  explicit XmlWriter(const Sink &sink);
+  ~XmlWriter();
+
+  XmlWriter(const XmlWriter &) = delete;
+  XmlWriter &operator=(const XmlWriter &) = delete;
+
+  void put(char ch) {
+    if (iFill == kBufferSize)
+      flushBuffer();
+    iBuffer[iFill++] = ch;
+  }
+  void put(const char *s) { put(s, strlen(s)); }
+  void put(const char *s, size_t len) {
+    if (len <= kBufferSize - iFill) {
+      memcpy(iBuffer + iFill, s, len);
+      iFill += len;
+    } else
+      putLong(s, len);
+  }
+
+  // Write a decimal integer.
+  void putInt(long long value);
+  // Write a floating point number.  By default it is formatted like
+  // printf's "%g", after setPrecision(n) it is rounded to n decimals
+  // and trailing zeros are dropped.
+  void putDouble(double value);
+  // Write a floating point number rounded to the given number of
+  // decimals (at most kMaxDecimals), without trailing zeros.
+  void putDecimal(double value, int decimals);
+  // Write value in lower-case hex, with at least minDigits digits.
+  void putHex(unsigned int value, int minDigits = 2);
+  // Write each byte of data as two lower-case hex digits.
+  void putHexBytes(const unsigned char *data, size_t len);
+  // Write data in base64.  Consecutive calls form a single base64
+  // stream, which must be terminated by finishBase64().
+  void putBase64(const unsigned char *data, size_t len);
+  void finishBase64();
+
+  // Set number of decimals for putDouble, or -1 for "%g" format.
+  // At most kMaxDecimals are used.
+  void setPrecision(int decimals) {
+    iPrecision = decimals < 0 ? -1 : std::min(decimals, kMaxDecimals);
+  }
+  int precision() const { return iPrecision; }
+
+  // Write buffered data to the file or string.
+  void flush();
+
+private:
+  static constexpr size_t kBufferSize = 1 << 16;
+
+  char *reserve(size_t len) {
+    if (len > kBufferSize - iFill)
+      flushBuffer();
+    return iBuffer + iFill;
+  }
+  void putLong(const char *s, size_t len);
+  void flushBuffer();
+  void write(const char *s, size_t len);
+
+private:
+  FILE *iFile;
+  std::string *iTarget; // used if iFile is null
+  Sink iSink;           // used if both are null
+  char *iBuffer;
+  size_t iFill;
+  int iPrecision;
+  unsigned char iBase64Carry[3]; // bytes waiting for a complete group
+  int iBase64Count;
+};
+
+// --------------------------------------------------------------------
+#endif
@@ -0,0 +1,173 @@
+// --------------------------------------------------------------------
+// Benchmark of the XmlWriter output
+// --------------------------------------------------------------------
+//
+// Build and run with "make bench CXXFLAGS=-O2".  Every case is run a
+// few times, and the fastest run is reported.
+
+#include "xmlwriter.h"
+
+#include <stdarg.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+// Number of path segments, bytes of image data, and how often each
+// case is run.
+#define NUM_SEGMENTS 1000000
+#define IMAGE_SIZE (16 << 20)
+#define ROUNDS 5
+
+// The output goes nowhere, so only the formatting is measured.
+static FILE *openNull() {
+  FILE *f = fopen("/dev/null", "wb");
+  return f ? f : tmpfile();
+}
+
+// How numbers were written before XmlWriter: formatted into a buffer
+// on the stack, then written to the file.
+static void writePSFmt(FILE *f, const char *fmt, ...) {
+  va_list args;
+  char buf[512];
+
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  fwrite(buf, 1, strlen(buf), f);
+}
+
+// Fastest of ROUNDS runs of f, in seconds.
+template <class F> static double fastest(F f) {
+  double best = 0.0;
+  for (int i = 0; i < ROUNDS; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    double s = std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+    if (i == 0 || s < best)
+      best = s;
+  }
+  return best;
+}
+
+static void report(const char *name, double before, double after, int n) {
+  printf("  %-22s printf %7.1f ns   XmlWriter %7.1f ns   %5.1fx\n", name,
+         1e9 * before / n, 1e9 * after / n, before / after);
+}
+
+// Path segments as written by XmlOutputDev, with coordinates of the
+// size found on a page.
+static void benchFormatting(FILE *out) {
+  std::mt19937 random(1);
+  std::uniform_real_distribution<double> coord(0.0, 612.0);
+  std::vector<double> xy(2 * NUM_SEGMENTS);
+  for (double &v : xy)
+    v = coord(random);
+
+  printf("number formatting, time per segment or integer (%d each)\n",
+         NUM_SEGMENTS);
+
+  double before = fastest([&] {
+    for (int i = 0; i < NUM_SEGMENTS; ++i)
+      writePSFmt(out, "%g %g l\n", xy[2 * i], xy[2 * i + 1]);
+    fflush(out);
+  });
+  double after = fastest([&] {
+    XmlWriter w(out);
+    for (int i = 0; i < NUM_SEGMENTS; ++i) {
+      w.putDouble(xy[2 * i]);
+      w.put(' ');
+      w.putDouble(xy[2 * i + 1]);
+      w.put(" l\n");
+    }
+  });
+  report("\"%g %g l\"", before, after, NUM_SEGMENTS);
+
+  before = fastest([&] {
+    for (int i = 0; i < NUM_SEGMENTS; ++i)
+      writePSFmt(out, "%.3f %.3f l\n", xy[2 * i], xy[2 * i + 1]);
+    fflush(out);
+  });
+  after = fastest([&] {
+    XmlWriter w(out);
+    w.setPrecision(3);
+    for (int i = 0; i < NUM_SEGMENTS; ++i) {
+      w.putDouble(xy[2 * i]);
+      w.put(' ');
+      w.putDouble(xy[2 * i + 1]);
+      w.put(" l\n");
+    }
+  });
+  report("-precision 3", before, after, NUM_SEGMENTS);
+
+  before = fastest([&] {
+    for (int i = 0; i < NUM_SEGMENTS; ++i)
+      writePSFmt(out, "%d", i);
+    fflush(out);
+  });
+  after = fastest([&] {
+    XmlWriter w(out);
+    for (int i = 0; i < NUM_SEGMENTS; ++i)
+      w.putInt(i);
+  });
+  report("\"%d\"", before, after, NUM_SEGMENTS);
+}
+
+static void reportRate(const char *name, double seconds, size_t bytes) {
+  printf("  %-22s %8.1f MB/s\n", name, bytes / seconds / (1 << 20));
+}
+
+// Image data as written by writeImageData, one scanline at a time.
+static void benchEncoding(FILE *out) {
+  std::mt19937 random(1);
+  std::vector<unsigned char> data(IMAGE_SIZE);
+  for (unsigned char &b : data)
+    b = random();
+  const size_t line = 3 * 1024; // a scanline of 1024 RGB pixels
+
+#if defined(__AVX2__)
+  const char *simd = "AVX2";
+#elif defined(__SSE2__)
+  const char *simd = "SSE2";
+#else
+  const char *simd = "no SIMD";
+#endif
+  printf("image data encoding, %d MB in scanlines of %zu bytes (%s)\n",
+         IMAGE_SIZE >> 20, line, simd);
+
+  double seconds = fastest([&] {
+    for (unsigned char b : data)
+      writePSFmt(out, "%02x", b);
+    fflush(out);
+  });
+  reportRate("hex, printf per byte", seconds, data.size());
+  seconds = fastest([&] {
+    XmlWriter w(out);
+    for (size_t i = 0; i < data.size(); i += line)
+      w.putHexBytes(&data[i], std::min(line, data.size() - i));
+  });
+  reportRate("hex, XmlWriter", seconds, data.size());
+  seconds = fastest([&] {
+    XmlWriter w(out);
+    for (size_t i = 0; i < data.size(); i += line)
+      w.putBase64(&data[i], std::min(line, data.size() - i));
+    w.finishBase64();
+  });
+  reportRate("base64, XmlWriter", seconds, data.size());
+}
+
+int main() {
+  FILE *out = openNull();
+  if (!out) {
+    fprintf(stderr, "Couldn't open an output file\n");
+    return 1;
+  }
+  benchFormatting(out);
+  benchEncoding(out);
+  fclose(out);
+  return 0;
+}
+
+// --------------------------------------------------------------------